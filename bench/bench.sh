@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# picasm -- bench/bench.sh
+#
+# Assemble a file several times and report the best wall clock
+# time and the input rate in bytes per second.
+# Needs a date(1) that supports %N (GNU coreutils).
+#
+# usage: bench.sh picasm-binary file.asm [runs] [picasm options]
+#
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 picasm-binary file.asm [runs] [picasm options]" >&2
+  exit 1
+fi
+
+bin=$1
+file=$2
+runs=${3:-7}
+[ $# -ge 3 ] && shift
+shift 2
+
+bytes=`wc -c < "$file"`
+best=
+i=0
+while [ $i -lt $runs ]; do
+  t0=`date +%s%N`
+  "$bin" "$@" "$file" > /dev/null 2>&1
+  t1=`date +%s%N`
+  t=`expr $t1 - $t0`
+  if [ -z "$best" ] || [ $t -lt $best ]; then
+    best=$t
+  fi
+  i=`expr $i + 1`
+done
+
+awk -v ns=$best -v bytes=$bytes -v file="$file" -v runs=$runs 'BEGIN {
+  printf("%s: %d bytes, best of %d runs %.4f s, %.0f MB/s\n",
+	 file, bytes, runs, ns/1e9, bytes/(ns/1e9)/1e6);
+}'
@@ -0,0 +1,42 @@
+/*
+ * picasm -- bench/gencmt.c
+ *
+ * Write a comment-heavy source file to standard output, for
+ * measuring how fast the lexer skips blanks and comments.
+ * The file is a DEVICE line followed by register map blocks
+ * that hold only comments and blank lines, like a large
+ * register definition header with the definitions left out.
+ *
+ * usage: gencmt [blocks] > cmt.asm   (default 60000 blocks, 18 MB)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_BLOCKS 60000L
+
+int
+main(int argc, char *argv[])
+{
+  long n, blocks;
+
+  blocks = (argc > 1 ? atol(argv[1]) : DEFAULT_BLOCKS);
+  if(blocks <= 0) {
+    fputs("usage: gencmt [blocks]\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  puts("\tdevice pic16c84");
+  for(n = 0; n < blocks; n++) {
+    puts(";----------------------------------------------------------------------");
+    printf("; device %ld register map\n", n);
+    puts(";----------------------------------------------------------------------");
+    puts("                          ; register description text"
+	 " register description text ");
+    puts(";    bit fields:  b0 b1 b2 b3 b4 b5 b6 b7");
+    puts("\t\t\t\t\t\t\t\t");
+    puts("");
+  }
+  puts("\tend");
+  return EXIT_SUCCESS;
+}
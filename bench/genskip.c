@@ -0,0 +1,64 @@
+/*
+ * picasm -- bench/genskip.c
+ *
+ * Write a device selection source file to standard output, for
+ * measuring how fast false conditional blocks are skipped.
+ * Each device has a block of register definitions, code, nested
+ * conditionals and comments inside 'if <device> == <selected>',
+ * so all blocks but one are skipped.
+ *
+ * usage: genskip [devices [selected]] > skip.asm
+ *        (default 40 devices, the last one selected, 84000 lines)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_DEVICES 40L
+#define DEVICE_ITEMS 1500 /* lines in a block, not counting the nops */
+
+int
+main(int argc, char *argv[])
+{
+  long dev, devices, selected;
+  int i;
+
+  devices = (argc > 1 ? atol(argv[1]) : DEFAULT_DEVICES);
+  selected = (argc > 2 ? atol(argv[2]) : devices-1);
+  if(devices <= 0) {
+    fputs("usage: genskip [devices [selected]]\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  puts("\tdevice pic16f84");
+  puts("\torg 0");
+  for(dev = 0; dev < devices; dev++) {
+    printf(" if %ld == %ld\n", dev, selected);
+    for(i = 0; i < DEVICE_ITEMS; i++) {
+      switch(i % 5) {
+	case 0:
+	  printf("R%ld_%d\tequ\t0x20\t; register\n", dev, i);
+	  break;
+
+	case 1:
+	  printf("\tmovlw\t0x%02x\n", i & 0xff);
+	  break;
+
+	case 2:
+	  printf("L%ld_%d:\taddwf\tR%ld_%d,1\n", dev, i, dev, i-2);
+	  break;
+
+	case 3:
+	  printf("  if defined(X%d)\n\tnop\n  endif\n", i);
+	  break;
+
+	default:
+	  printf("; comment line %d for device %ld\n", i, dev);
+	  break;
+      }
+    }
+    puts(" endif");
+  }
+  puts("\tend");
+  return EXIT_SUCCESS;
+}
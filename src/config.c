@@ -72,21 +72,21 @@ cfg_error:
       error(1, "CONFIG syntax error");
       return;
     }
+    /* no CONFIG keyword is this long */
+    if(cur_token.len >= (int)sizeof(symname))
+      goto cfg_error;
     strcpy(symname, token_string);
     get_token();
 
-    /* hmm... this is a little kludge, but as
-       the tokenizer now makes 'local id's from
-       the valid config strings, this must be used... */
-    if(token_type != TOK_LOCAL_ID) {
-      if(token_type != TOK_EQUAL) {
-	error(1, "'=' expected");
-	return;
-      }
-      get_token();
-      if(token_type != TOK_IDENTIFIER)
-	goto cfg_error;
+    /* the tokenizer makes a local id of '=value' */
+    split_local_id();
+    if(token_type != TOK_EQUAL) {
+      error(1, "'=' expected");
+      return;
     }
+    get_token();
+    if(token_type != TOK_IDENTIFIER)
+      goto cfg_error;
 
     switch(strsel("OSC\0WDT\0CP\0PWRT\0MCLR\0BOD\0MPE\0", symname)) {
       case 0: /* OSC */
@@ -22,7 +22,7 @@ expr_element(void)
 {
   long val, tval;
   struct symbol *sym;
-  static unsigned char strbuf[256];
+  struct token str;
   int symtype;
 
   if(expr_error)
@@ -73,7 +73,7 @@ expr_element(void)
       symtype =
 	(token_type == TOK_IDENTIFIER ? SYMTAB_GLOBAL : SYMTAB_LOCAL);
 
-      if((sym = lookup_symbol(token_string, symtype)) == NULL)
+      if((sym = lookup_token_symbol(&cur_token, symtype)) == NULL)
 	val = EXPR_FALSE;
       else if(sym->type == SYM_DEFINED || sym->type == SYM_SET)
 	val = EXPR_TRUE;
@@ -104,7 +104,7 @@ expr_element(void)
 	expr_error = 1;
 	return EXPR_FALSE;
       }
-      strcpy(strbuf, token_string);
+      str = cur_token;
 
       get_token();
       if(token_type != TOK_COMMA) {
@@ -120,7 +120,9 @@ expr_element(void)
 	return EXPR_FALSE;
       }
 
-      val = (strcmp(token_string, strbuf) == 0 ? EXPR_TRUE : EXPR_FALSE);
+      val = (cur_token.len == str.len &&
+	     memcmp(cur_token.text, str.text, str.len) == 0 ?
+	     EXPR_TRUE : EXPR_FALSE);
 
       get_token();
       if(token_type != TOK_RIGHTPAR) {
@@ -177,7 +179,7 @@ expr_element(void)
 	expr_error = 1;
 	return -1;
       }
-      strcpy(strbuf, token_string);
+      str = cur_token;
 
       get_token();
       if(token_type != TOK_COMMA) {
@@ -188,10 +190,10 @@ expr_element(void)
 
       get_token();
       val = get_expression();
-      if(val < 0 || val >= (long)strlen(strbuf))
+      if(val < 0 || val >= str.len)
 	val = -1;
       else
-	val = strbuf[val];
+	val = (unsigned char)str.text[val];
 
       if(token_type != TOK_RIGHTPAR) {
 	error(1, "')' expected");
@@ -244,7 +246,7 @@ expr_element(void)
 	return 0;
       }
 
-      if((sym = lookup_symbol(token_string, symtype)) == NULL) {
+      if((sym = lookup_token_symbol(&cur_token, symtype)) == NULL) {
 	error(1, "Undefined symbol '%s%s'",
 	      (symtype == SYMTAB_LOCAL ? "=" : ""),
 	      token_string);
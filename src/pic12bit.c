@@ -145,10 +145,10 @@ assemble_12bit_mnemonic(int op)
 	  return FAIL;
 	}
 
-	sym = lookup_symbol(token_string, symtype);
+	sym = lookup_token_symbol(&cur_token, symtype);
 	if(sym == NULL || sym->type == SYM_FORWARD) {
 	  if(sym == NULL) {
-	    sym = add_symbol(token_string, symtype);
+	    sym = add_token_symbol(&cur_token, symtype);
 	    sym->type = SYM_FORWARD;
 	  }
 
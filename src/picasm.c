@@ -19,12 +19,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
-#include <ctype.h>
 #include <time.h>
 
 #include "picasm.h"
 
 int warnlevel;
+int macro_depth_limit;
 
 static int total_line_count;
 static int errors, warnings; /* error & warning counts */
@@ -36,6 +36,12 @@ extern struct pic_type pic_types[];
 
 static FILE *list_fp;
 static int listing_on;
+
+/* listing of macro and loop expansion lines (OPT mex/nomex/onlycode) */
+#define MEX_ALL  0 /* all lines */
+#define MEX_NONE 1 /* only the macro call line */
+#define MEX_CODE 2 /* only lines that generate code or data */
+static int list_mex;
 static int list_loc;
 static pic_instr_t *list_ptr;
 static long list_val, list_len;
@@ -46,11 +52,18 @@ int unique_id_count;
 /* the current source file/macro */
 struct inc_file *current_file;
 
-/* Line buffer & pointer to it */
+/*
+ * The current source line (points into the source file, or
+ * into the macro expansion buffer) and the lexer position in it.
+ * 'line_shown' is the text shown for the line in the listing and
+ * in messages if it is not the text read (for the ENDR of a loop).
+ */
 char *line_buf_ptr;
-char line_buffer[256];
+char *line_start, *line_end;
+char *line_shown;
 
 static struct patch *global_patch_list;
+static struct pool patch_pool = { "patches", sizeof(struct patch) };
 struct patch **local_patch_list_ptr;
 
 struct pic_type *pic_type;
@@ -75,6 +88,22 @@ int org_val;
 
 int local_level;
 
+/*
+ * Write the current source line, with a newline
+ * at the end even if the line has none
+ */
+static void
+write_line(FILE *fp)
+{
+  if(line_shown != NULL) {
+    fputs(line_shown, fp);
+  } else if(line_start != NULL && line_end > line_start) {
+    fwrite(line_start, 1, line_end-line_start, fp);
+    if(line_end[-1] != '\n')
+      fputc('\n', fp);
+  }
+}
+
 /* Error handling */
 /*
  * Show line number/line with error message
@@ -86,17 +115,18 @@ err_line_ref(void)
 
   if(current_file != NULL) {
     inc = current_file;
-    if(inc->type != INC_FILE) {
+    if(inc->type == INC_REPT) {
+      fprintf(stderr, "(%s line %d) ",
+	      (inc->v.m.loop == KW_REPT ? "REPT" : "WHILE"), inc->linenum);
+    } else if(inc->type != INC_FILE) {
       fprintf(stderr, "(Macro %s line %d) ",
 	      inc->v.m.sym->name, inc->linenum);
-      while(inc != NULL && inc->type != INC_FILE)
-	inc = inc->next;
     }
+    while(inc != NULL && inc->type != INC_FILE)
+      inc = inc->next;
     fprintf(stderr, "File '%s' at line %d:\n",
 	    inc->v.f.fname, inc->linenum);
-    fputs(line_buffer, stderr);
-    if(line_buffer[0] != '\0' && line_buffer[strlen(line_buffer)-1] != '\n')
-      fputc('\n', stderr);
+    write_line(stderr);
   }
 }
 
@@ -112,13 +142,15 @@ warning(char *fmt, ...)
   fputs("Warning: ", stderr);
   va_start(args, fmt);
   vfprintf(stderr, fmt, args);
+  va_end(args);
   if(list_fp != NULL) {
     fputs("Warning: ", list_fp);
+    va_start(args, fmt); /* the list can't be read twice */
     vfprintf(list_fp, fmt, args);
+    va_end(args);
     fputc('\n', list_fp);
   }
   fputc('\n', stderr);
-  va_end(args);
   warnings++;
 }
 
@@ -147,13 +179,15 @@ error(int lskip, char *fmt, ...)
   fputs("Error: ", stderr);
   va_start(args, fmt);
   vfprintf(stderr, fmt, args);
+  va_end(args);
   if(list_fp != NULL) {
     fputs("Error: ", list_fp);
+    va_start(args, fmt); /* the list can't be read twice */
     vfprintf(list_fp, fmt, args);
+    va_end(args);
     fputc('\n', list_fp);
   }
   fputc('\n', stderr);
-  va_end(args);
   if(++errors >= MAX_ERRORS)
     fatal_error("too many errors, aborting");
 	
@@ -190,6 +224,113 @@ mem_alloc(int size)
   return p;
 }
 
+void *
+mem_realloc(void *p, int size)
+{
+  if((p = realloc(p, size)) == NULL)
+    fatal_error("Out of memory");
+
+  return p;
+}
+
+/*
+ * Arena for memory that is kept until the end of assembly
+ * (macro definitions, global symbols, and the free lists of pools).
+ * Blocks are taken from it in order, and all of it is released
+ * at once by release_assembler(). The memory is charged to a pool
+ * for statistics.
+ */
+#define ARENA_BLOCK 16384
+
+struct arena_block {
+  struct arena_block *next;
+  union arena_align data[1];
+};
+
+static struct arena_block *arena;
+static char *arena_ptr, *arena_end;
+static struct pool *pool_list; /* pools that have taken memory */
+
+void *
+arena_alloc(struct pool *pl, int size)
+{
+  struct arena_block *ab;
+  void *p;
+  int n;
+
+  if(pl->bytes == 0) {
+    pl->next = pool_list;
+    pool_list = pl;
+  }
+
+  size = ARENA_ROUND(size);
+  pl->bytes += size;
+  if(size > arena_end-arena_ptr) {
+    n = (size > ARENA_BLOCK ? size : ARENA_BLOCK);
+    ab = mem_alloc(sizeof(struct arena_block) + n);
+    ab->next = arena;
+    arena = ab;
+    arena_ptr = (char *)ab->data;
+    arena_end = arena_ptr + n;
+  }
+  p = arena_ptr;
+  arena_ptr += size;
+  return p;
+}
+
+static void
+arena_release(void)
+{
+  struct arena_block *ab;
+  struct pool *pl;
+
+  while((ab = arena) != NULL) {
+    arena = ab->next;
+    mem_free(ab);
+  }
+  arena_ptr = arena_end = NULL;
+
+  for(pl = pool_list; pl != NULL; pl = pl->next) {
+    pl->free_list = NULL;
+    pl->bytes = 0;
+  }
+  pool_list = NULL;
+}
+
+/*
+ * Pools of fixed size objects. Freed objects are kept
+ * in a free list for reuse, new ones come from the arena.
+ */
+void *
+pool_alloc(struct pool *pl)
+{
+  struct pool_free *p;
+
+  if((p = pl->free_list) == NULL)
+    return arena_alloc(pl, pl->size);
+  pl->free_list = p->next;
+  return p;
+}
+
+void
+pool_free(struct pool *pl, void *p)
+{
+  ((struct pool_free *)p)->next = pl->free_list;
+  pl->free_list = p;
+}
+
+/*
+ * Print the memory taken by each pool
+ */
+static void
+print_memory_stats(FILE *fp)
+{
+  struct pool *pl;
+
+  for(pl = pool_list; pl != NULL; pl = pl->next)
+    fprintf(fp, "Memory for %s: %ld bytes\n", pl->name, pl->bytes);
+}
+
 /*
  * initialize the assembler
  */
@@ -200,6 +341,7 @@ init_assembler(void)
   int n;
 
   init_symtab(); /* initialize symbol table */
+  init_tokenizer(); /* build keyword index */
 
   /* initialize program memory to invalid values */
   for(n = PROGMEM_MAX, cp = prog_mem; n-- > 0; *cp++ = INVALID_INSTR);
@@ -237,6 +379,22 @@ init_assembler(void)
   ifskip_mode = 0;
 }
 
+/*
+ * Free the memory used by an assembly. The tables that point
+ * into the arena are emptied before it is released, so that
+ * init_assembler() can start another assembly.
+ */
+static void
+release_assembler(void)
+{
+  release_symtab();
+  release_tokenizer();
+  release_sources();
+  global_patch_list = NULL;
+  local_patch_list_ptr = NULL;
+  arena_release();
+}
+
 /*
  * generate program code
  */
@@ -441,13 +599,19 @@ write_listing_line(int cond_flag)
   int i;
 
   if(list_fp != NULL && listing_on) {
+    if(list_mex != MEX_ALL && current_file != NULL
+       && current_file->type != INC_FILE
+       && (list_mex == MEX_NONE
+	   || (list_flags & (LIST_PROG|LIST_EDATA|LIST_PTR)) == 0))
+      goto skip_line;
+
     fprintf(list_fp, "%04d%c%c",
 	    ++total_line_count,
-	    (current_file != NULL && current_file->type == INC_MACRO ?
+	    (current_file != NULL && current_file->type != INC_FILE ?
 	     '+' : ' '),
 	    (cond_flag ? '!' : ' '));
 
-    if(line_buffer[0] != '\0') {
+    if(line_start != NULL && line_end > line_start) {
       if(list_flags & LIST_VAL)	{
 	fprintf(list_fp, "%08lX  ", list_val);
       } else {
@@ -470,10 +634,7 @@ write_listing_line(int cond_flag)
 	}
       }
 
-      fputs(line_buffer, list_fp);
-      if(line_buffer[0] != '\0'
-	 && line_buffer[strlen(line_buffer)-1] != '\n')
-	fputc('\n', list_fp);
+      write_line(list_fp);
 
       list_len--;
       for(i = 0; i < list_len; i++) {
@@ -481,7 +642,7 @@ write_listing_line(int cond_flag)
 	fprintf(list_fp, "%04d%c ",
 		total_line_count,
 		(current_file != NULL
-		 && current_file->type == INC_MACRO ?
+		 && current_file->type != INC_FILE ?
 		 '+' : ' '));
 
 	if(list_flags & LIST_LOC)
@@ -499,6 +660,7 @@ write_listing_line(int cond_flag)
       }
     }
 
+skip_line:
     if(listing_on < 0)
       listing_on = 0;
   }
@@ -506,6 +668,22 @@ write_listing_line(int cond_flag)
   list_len = 0;
 }
 
+/*
+ * Look up a macro expansion listing mode by name.
+ * Returns -1 if the name is not valid.
+ */
+static int
+mex_mode(char *name)
+{
+  if(strcasecmp(name, "mex") == 0)
+    return MEX_ALL;
+  if(strcasecmp(name, "nomex") == 0)
+    return MEX_NONE;
+  if(strcasecmp(name, "onlycode") == 0)
+    return MEX_CODE;
+  return -1;
+}
+
 /*
  * parse and handle OPT-directive
  * (this is special as it must be done as macro definition time
@@ -514,6 +692,8 @@ write_listing_line(int cond_flag)
 static int
 handle_opt(void)
 {
+  int mode;
+
   if(token_type != TOK_IDENTIFIER) {
     error(1, "OPT syntax error");
     return FAIL;
@@ -529,6 +709,8 @@ handle_opt(void)
   } else if(strcasecmp(token_string, "l") == 0
 	  || strcasecmp(token_string, "list") == 0) {
     listing_on = 1;
+  } else if((mode = mex_mode(token_string)) >= 0) {
+    list_mex = mode;
   } else {
     error(1, "OPT syntax error");
     return FAIL;
@@ -542,10 +724,9 @@ handle_opt(void)
  * Define a macro
  */
 static void
-define_macro(char *name)
+define_macro(struct token *name)
 {
   struct symbol *sym;
-  struct macro_line *ml;
   int t;
 
   if(token_type != TOK_NEWLINE && token_type != TOK_EOF)
@@ -554,10 +735,8 @@ define_macro(char *name)
 
   write_listing_line(0);
 
-  sym = add_symbol(name, SYMTAB_GLOBAL);
+  sym = add_token_symbol(name, SYMTAB_GLOBAL);
   sym->type = SYM_MACRO;
-  sym->v.text = NULL;
-  ml = NULL;
 
   for(;;) {
     get_token(); /* read first token on next line */
@@ -582,31 +761,92 @@ define_macro(char *name)
       get_token();
       handle_opt();
     } else {
-      if(ml == NULL) {
-	ml = mem_alloc(sizeof(struct macro_line)
-		       +strlen(line_buffer));
-	sym->v.text = ml;
-      } else {
-	ml->next = mem_alloc(sizeof(struct macro_line)
-			     +strlen(line_buffer));
-	ml = ml->next;
-      }
-      strcpy(ml->text, line_buffer);
-      ml->next = NULL;
+      compile_macro_line(line_start, line_end-line_start);
     }
 
     write_listing_line(0);
 
-    line_buf_ptr = NULL;
-    tok_char = ' ';
+    skip_eol();
   }
   if(t)
     error(0, "Label not allowed with ENDM");
+  sym->v.def = end_macro_def();
   get_token();
 }
 
 /*
- * Skip subroutine used by the conditional assembly directives
+ * Read the body of a REPT or WHILE loop, up to the matching ENDR,
+ * starting from the first token of the line after REPT/WHILE.
+ * 'endr' is the text of the line that ends the body (for WHILE,
+ * ENDR followed by the loop condition). If 'endr' is NULL, the
+ * body is skipped and NULL is returned.
+ */
+static struct macro_line *
+read_loop_body(char *endr, int endr_len)
+{
+  struct macro_line *body, *ml, *new_ml;
+  int t, nest, len;
+
+  body = ml = NULL;
+  nest = 0;
+  for(;;) {
+    t = 0;
+    if(token_type == TOK_IDENTIFIER) {
+      t = 1;
+      get_token();
+      if(token_type == TOK_COLON)
+	get_token();
+    }
+    if(token_type == TOK_EOF || token_type == KW_END)
+      fatal_error("REPT/WHILE not terminated by ENDR");
+
+    if(token_type == KW_REPT || token_type == KW_WHILE)
+      nest++;
+    else if(token_type == KW_ENDR && nest-- == 0)
+      break;
+
+    if(endr != NULL) {
+      new_ml = new_macro_line(line_start, line_end-line_start);
+      if(ml == NULL)
+	body = new_ml;
+      else
+	ml->next = new_ml;
+      ml = new_ml;
+    }
+
+    write_listing_line(0);
+
+    skip_eol();
+    get_token(); /* read first token on next line */
+  }
+  if(t)
+    error(0, "Label not allowed with ENDR");
+
+  if(endr != NULL) {
+    new_ml = new_macro_line(endr, endr_len);
+    if(ml == NULL)
+      body = new_ml;
+    else
+      ml->next = new_ml;
+
+    /* the listing shows the ENDR line of the source */
+    len = line_end-line_start;
+    new_ml->shown = mem_alloc(len+2);
+    memcpy(new_ml->shown, line_start, len);
+    if(len == 0 || line_start[len-1] != '\n')
+      new_ml->shown[len++] = '\n';
+    new_ml->shown[len] = '\0';
+  }
+
+  get_token();
+  return body;
+}
+
+/*
+ * Skip subroutine used by the conditional assembly directives.
+ * Only the lines that may contain IF, ELSE, ENDIF or END are
+ * tokenized, the others are just listed. When nothing is listed,
+ * a block that has been skipped before is jumped over directly.
  * return: -1=premature EOF, 0=ok, 1=label (not allowed)
  */
 static int
@@ -616,8 +856,14 @@ if_else_skip(void)
 
   ccount = 0;
   ifskip_mode++;
-  do {
+  begin_skip(list_fp == NULL || !listing_on
+	     || (list_mex != MEX_ALL && current_file->type != INC_FILE));
+  for(;;) {
     skip_eol();
+    if(!read_skipped_line()) {
+      write_listing_line(1);
+      continue;
+    }
     get_token();
     write_listing_line(1);
 
@@ -636,13 +882,58 @@ if_else_skip(void)
       ccount--;
     } else if(token_type == KW_ELSE && ccount <= 0) {
       break;
+    } else if(token_type == TOK_EOF || token_type == KW_END) {
+      break;
     }
-  } while(token_type != TOK_EOF && token_type != KW_END);
+  }
+  if(token_type == KW_ELSE || token_type == KW_ENDIF)
+    end_skip();
 
   ifskip_mode--;
   return (token_type == TOK_EOF || token_type == KW_END) ? -1 : t;
 }
 
+/*
+ * Include guard detection. An include file has a guard if
+ * everything in it (other than empty lines and comments) is inside
+ * a conditional that begins with 'if ~defined(symbol)' and has no
+ * ELSE. Called at the start of the non-empty lines that are not
+ * inside the guard conditional.
+ */
+static void
+check_include_guard(void)
+{
+  struct token *t;
+
+  if(current_file->v.f.guard == GUARD_START && token_type == KW_IF
+     && peek_token(1)->type == TOK_BITNOT
+     && peek_token(2)->type == KW_DEFINED
+     && peek_token(3)->type == TOK_LEFTPAR
+     && (t = peek_token(4))->type == TOK_IDENTIFIER
+     && peek_token(5)->type == TOK_RIGHTPAR
+     && peek_token(6)->type == TOK_NEWLINE) {
+    current_file->v.f.guard = GUARD_IF;
+    current_file->v.f.guard_name = mem_alloc(t->len+1);
+    memcpy(current_file->v.f.guard_name, t->text, t->len);
+    current_file->v.f.guard_name[t->len] = '\0';
+  } else {
+    current_file->v.f.guard = GUARD_NONE;
+  }
+}
+
+/*
+ * Called when a conditional at nesting level 'level' reaches
+ * ELSE or ENDIF ('tok'), to see if it was an include guard
+ */
+static void
+guard_cond_end(int tok, int level)
+{
+  if(current_file != NULL && current_file->type == INC_FILE
+     && current_file->v.f.guard == GUARD_IF
+     && level == current_file->cond_nest_count)
+    current_file->v.f.guard = (tok == KW_ENDIF ? GUARD_CLOSED : GUARD_NONE);
+}
+
 /*
  * Add a patch pointing to the current location
  */
@@ -664,7 +955,7 @@ add_patch(int tab, struct symbol *sym, patchtype_t type)
     prog_location = org_val;
   }
 
-  ptch = mem_alloc(sizeof(struct patch));
+  ptch = pool_alloc(&patch_pool);
   ptch->label = sym;
   ptch->type = type;
   ptch->location = prog_location;
@@ -718,7 +1009,7 @@ apply_patches(struct patch *patch_list)
 	      | (ptch->label->v.value & 0x7ff);
 	  break;
       }
-    mem_free(ptch);
+    pool_free(&patch_pool, ptch);
   }
 }
 
@@ -743,10 +1034,10 @@ gen_byte_c(int instr_code)
       return FAIL;
     }
 
-    sym = lookup_symbol(token_string, symtype);
+    sym = lookup_token_symbol(&cur_token, symtype);
     if(sym == NULL || sym->type == SYM_FORWARD)	{
       if(sym == NULL) {
-	sym = add_symbol(token_string, symtype);
+	sym = add_token_symbol(&cur_token, symtype);
 	sym->type = SYM_FORWARD;
       }
 
@@ -799,11 +1090,14 @@ static void
 assembler(char *fname)
 {
   static char symname[256];
+  struct token label;
   struct symbol *sym;
   int op, t, symtype;
   long val;
-  char *cp;
+  char *cp, *incname, *endr;
   struct pic_type *pic;
+  struct inc_file *inc;
+  struct macro_line *body;
 
   if(pic_type != NULL) {
     sprintf(symname, "__%s", pic_type->name);
@@ -817,6 +1111,12 @@ assembler(char *fname)
 
   while(token_type != TOK_EOF) {
     sym = NULL;
+    if(token_type != TOK_NEWLINE && current_file != NULL
+       && current_file->type == INC_FILE
+       && (current_file->v.f.guard == GUARD_START
+	   || current_file->v.f.guard == GUARD_CLOSED))
+      check_include_guard();
+
     if(token_type == TOK_IDENTIFIER || token_type == TOK_LOCAL_ID) {
       symtype =
 	(token_type == TOK_IDENTIFIER ? SYMTAB_GLOBAL : SYMTAB_LOCAL);
@@ -828,18 +1128,13 @@ assembler(char *fname)
 
       t = (line_buf_off == 0);
 
-      strcpy(symname, token_string);
-      sym = lookup_symbol(symname, symtype);
+      /* the label text stays in the source line while it is used */
+      label = cur_token;
+      sym = lookup_token_symbol(&label, symtype);
       if(sym != NULL && sym->type == SYM_MACRO) {
-	/* skip whitespace */
-	while(tok_char != '\n' && isspace(tok_char))
-	  read_src_char();
-
-	if(line_buf_ptr != NULL &&
-	   strncasecmp(line_buf_ptr-1, "macro", 5) == 0 &&
-	   line_buf_ptr[4] != '.' && line_buf_ptr[4] != '_' &&
-	   !isalnum((unsigned char)line_buf_ptr[4])) {
-	  error(1, "Multiple definition of macro '%s'", symname);
+	if(peek_token(1)->type == KW_MACRO) {
+	  error(1, "Multiple definition of macro '%.*s'",
+		label.len, label.text);
 	  continue;
 	}
 
@@ -857,7 +1152,7 @@ assembler(char *fname)
 		  sym->name);
 	    continue;
 	  }
-	  define_macro(symname);
+	  define_macro(&label);
 	  goto line_end;
 
 	case KW_EQU:
@@ -867,7 +1162,7 @@ assembler(char *fname)
 		    (symtype == SYMTAB_LOCAL ? "=" : ""),
 		    sym->name);
 	  } else
-	    sym = add_symbol(symname, symtype);
+	    sym = add_token_symbol(&label, symtype);
 	  get_token();
 	  sym->type = SYM_DEFINED;
 	  sym->v.value = get_expression();
@@ -884,7 +1179,7 @@ assembler(char *fname)
 		  (symtype == SYMTAB_LOCAL ? "=" : ""),
 		  sym->name);
 	  else if(sym == NULL)
-	    sym = add_symbol(symname, symtype);
+	    sym = add_token_symbol(&label, symtype);
 	  get_token();
 	  sym->type = SYM_SET;
 	  sym->v.value = get_expression();
@@ -930,7 +1225,7 @@ do_label:
 		    (symtype == SYMTAB_LOCAL ? "=" : ""),
 		    sym->name);
 	    if(sym == NULL)
-	      sym = add_symbol(symname, symtype);
+	      sym = add_token_symbol(&label, symtype);
 	    sym->type = SYM_DEFINED;
 	    sym->v.value = t;
 	    list_loc = t;
@@ -949,7 +1244,7 @@ do_label:
     }
 
     if(token_type == TOK_IDENTIFIER &&
-       (sym = lookup_symbol(token_string, SYMTAB_GLOBAL))
+       (sym = lookup_token_symbol(&cur_token, SYMTAB_GLOBAL))
        != NULL && sym->type == SYM_MACRO) {
       expand_macro(sym);
       continue;
@@ -959,11 +1254,14 @@ do_label:
       break;
 
     if(token_type == KW_ERROR) {
-      while(isspace((unsigned char)(*line_buf_ptr)))
-	 line_buf_ptr++;
-      error(1, "%s", line_buf_ptr);
+      t = get_rest_of_line(&cp);
+      error(1, "%.*s", t, cp);
       continue;
     }
+
+    /* the WHILE condition is also kept as text */
+    if(token_type == KW_WHILE)
+      cp = cur_token.text + cur_token.len;
 	  
     op = token_type;
     get_token();
@@ -975,17 +1273,28 @@ do_label:
 	continue;
       }
 
-      strcpy(symname, token_string);
+      incname = mem_alloc(cur_token.len+1);
+      strcpy(incname, token_string);
       get_token();
       if(token_type != TOK_NEWLINE && token_type != TOK_EOF)
 	error(0, "Extraneous characters after a valid source line");
 
-      begin_include(symname);
+      if(!skip_include(incname))
+	begin_include(incname);
+      mem_free(incname);
 
       write_listing_line(0);
       get_token();
       continue;
 
+    case KW_INCLUDEONCE:
+      if(current_file->type != INC_FILE) {
+	error(1, "INCLUDEONCE not allowed in a macro");
+	continue;
+      }
+      current_file->v.f.src->once = 1;
+      break;
+
     case KW_SET:
     case KW_EQU:
       if(sym == NULL)
@@ -1008,12 +1317,101 @@ do_label:
        * nobody noticed that it wasn't implemented
        * at all in previous versions.
        */
-      if(current_file == NULL || current_file->type != INC_MACRO) {
+      for(inc = current_file; inc != NULL && inc->type == INC_REPT;
+	  inc = inc->next)
+	;
+      if(inc == NULL || inc->type != INC_MACRO) {
 	error(1, "EXITM not allowed outside a macro");
 	continue;
       }
-      cond_nest_count = current_file->cond_nest_count;
-      end_include();
+      /* also leave the loops inside the macro */
+      while(current_file != inc) {
+	cond_nest_count = current_file->cond_nest_count;
+	end_include();
+      }
+      exit_macro();
+      break;
+
+    case KW_REPT:
+    case KW_WHILE:
+      /* the body ends with an ENDR line that has the WHILE condition */
+      if(op == KW_WHILE) {
+	while(IS_SPACE(*cp))
+	  cp++;
+	t = line_end-cp;
+	endr = mem_alloc(t+7);
+	memcpy(endr, "\tendr ", 6);
+	memcpy(endr+6, cp, t);
+      } else {
+	t = 0;
+	endr = mem_alloc(7);
+	memcpy(endr, "\tendr\n", 6);
+      }
+
+      val = get_expression();
+      if(expr_error) {
+	/* the line has been skipped, skip the body too */
+	mem_free(endr);
+	endr = NULL;
+	val = 0;
+      } else {
+	if(op == KW_REPT && val > LOOP_MAX) {
+	  error(0, "Too many REPT iterations (max. %d)", LOOP_MAX);
+	  val = 0;
+	}
+	if(token_type != TOK_NEWLINE && token_type != TOK_EOF)
+	  error(0, "Extraneous characters after a valid source line");
+	skip_eol();
+	write_listing_line(0);
+	get_token(); /* read first token on next line */
+      }
+
+      body = read_loop_body(endr, t+6);
+      mem_free(endr);
+      write_listing_line(0);
+      if(token_type != TOK_NEWLINE && token_type != TOK_EOF)
+	error(0, "Extraneous characters after a valid source line");
+
+      if(op == KW_REPT ? val > 0 : val != 0) {
+	begin_loop(body, op, (op == KW_REPT ? val : 1));
+      } else {
+	free_macro_lines(body);
+	get_token();
+      }
+      continue;
+
+    case KW_ENDR:
+      if(current_file == NULL || current_file->type != INC_REPT
+	 || current_file->v.m.ml != NULL) {
+	error(1, "ENDR without REPT or WHILE");
+	continue;
+      }
+      if(cond_nest_count != current_file->cond_nest_count) {
+	error(0, "conditional assembly not terminated by ENDIF");
+	cond_nest_count = current_file->cond_nest_count;
+      }
+
+      if(current_file->v.m.loop == KW_REPT) {
+	t = (--current_file->v.m.count > 0);
+      } else {
+	val = get_expression();
+	if(expr_error) /* the line has been skipped, ending the loop */
+	  continue;
+	t = (val != 0);
+	if(t && ++current_file->v.m.count > LOOP_MAX) {
+	  error(0, "WHILE loop not ended after %d iterations", LOOP_MAX);
+	  t = 0;
+	}
+      }
+
+      if(t) { /* next iteration */
+	current_file->v.m.ml = current_file->v.m.body;
+	current_file->linenum = 0;
+      } else { /* list the line as part of the loop */
+	write_listing_line(0);
+	end_include();
+	goto line_end2;
+      }
       break;
 
     case KW_OPT:
@@ -1055,6 +1453,7 @@ do_label:
 	  error(0, "Label not allowed with %s",
 		(token_type == KW_ELSE ? "ELSE" : "ENDIF"));
 
+	guard_cond_end(token_type, cond_nest_count);
 	if(token_type == KW_ELSE)
 	  cond_nest_count++;
 	get_token();
@@ -1071,6 +1470,7 @@ do_label:
 	 || cond_nest_count <= current_file->cond_nest_count)
 	error(0, "ELSE without IF");
 
+      guard_cond_end(KW_ELSE, cond_nest_count-1);
       write_listing_line(0);
       t = if_else_skip();
       if(t == -1)
@@ -1096,6 +1496,7 @@ do_label:
 	error(0, "ENDIF without IF");
 
       cond_nest_count--;
+      guard_cond_end(KW_ENDIF, cond_nest_count);
       break;
 
     case KW_ORG:
@@ -1380,7 +1781,7 @@ main(int argc, char *argv[])
 {
   static char in_filename[256], out_filename[256], list_filename[256];
   static int out_format = IHX8M;
-  static int listing = 0, symdump = 0;
+  static int listing = 0, symdump = 0, verbose = 0;
   char *p;
   time_t ti;
   struct tm *tm;
@@ -1389,6 +1790,7 @@ main(int argc, char *argv[])
   out_filename[0] = '\0';
   list_filename[0] = '\0';
   warnlevel = 0;
+  macro_depth_limit = MACRO_DEPTH;
 
   while(argc > 1 && argv[1][0] == '-') {
     switch(argv[1][1]) {
@@ -1440,9 +1842,19 @@ main(int argc, char *argv[])
 	  strcpy(list_filename, &argv[1][2]);
 	break;
 
-      case 's':
-        symdump = 1;
-        break;
+      case 'm': /* macro expansion listing mode */
+	if((list_mex = mex_mode(&argv[1][2])) < 0)
+	  goto usage;
+	break;
+
+      case 's': /* symbol table listing, by name or by value */
+	if(argv[1][2] == '\0' || strcmp(&argv[1][2], "n") == 0)
+	  symdump = SYMSORT_NAME;
+	else if(strcmp(&argv[1][2], "v") == 0)
+	  symdump = SYMSORT_VALUE;
+	else
+	  goto usage;
+	break;
 
       case 'w': /* warning mode (gives some more warnings) */
 	if(argv[1][2] != '\0') {
@@ -1452,10 +1864,17 @@ main(int argc, char *argv[])
 	}
 	break;
 
-      case 'v': /* version info */
+      case 'd': /* maximum macro expansion depth */
+	macro_depth_limit = atoi(&argv[1][2]);
+	if(macro_depth_limit <= 0)
+	  goto usage;
+	break;
+
+      case 'v': /* version info and statistics */
 	fprintf(stderr,
 		"12/14-bit PIC assembler " VERSION
 		" -- Copyright 1995-1998 by Timo Rossi\n");
+	verbose = 1;
 	break;
 	
       case '-': /* end of option list */
@@ -1474,8 +1893,9 @@ main(int argc, char *argv[])
 opt_done:
   if(argc != 2) {
 usage:
-    fputs("Usage: picasm [-o<objname>] [-l<listfile>] [-s] [-ihx8m/ihx16]\n"
-	  "              [-pic<device>] [-w[n]] <filename>\n", stderr);
+    fputs("Usage: picasm [-o<objname>] [-l<listfile>] [-s[n|v]] [-ihx8m/ihx16]\n"
+	  "              [-pic<device>] [-w[n]] [-d<depth>] [-m<mode>] [-v]\n"
+	  "              <filename>\n", stderr);
     exit(EXIT_FAILURE);
   }
 
@@ -1526,11 +1946,18 @@ usage:
   if(warnings != 0)
     fprintf(stderr, "%d warning%s\n", warnings, warnings == 1 ? "" : "s");
 
+  if(verbose) {
+    print_source_stats(stderr);
+    print_macro_stats(stderr);
+    print_memory_stats(stderr);
+  }
+
   if(list_fp)
     {
       if(symdump)
-        dump_symtab(list_fp);
+        dump_symtab(list_fp, symdump);
       fclose(list_fp);
     }
+  release_assembler();
   return EXIT_SUCCESS;
 }
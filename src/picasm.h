@@ -52,6 +52,15 @@
 /* maximum number of errors before aborting assembly */
 #define MAX_ERRORS 20
 
+/* maximum number of REPT/WHILE loop iterations */
+#define LOOP_MAX 65536
+
+/* default maximum macro expansion depth (-d option) */
+#define MACRO_DEPTH 1000
+
+/* maximum number of macro tail calls in one expansion frame */
+#define TAIL_CALL_MAX 1000000L
+
 /* output formats */
 enum {
   IHX8M,
@@ -84,9 +93,73 @@ typedef unsigned short pic_instr_t;
 /* inc_file types */
 typedef enum {
   INC_FILE,
-  INC_MACRO
+  INC_MACRO,
+  INC_REPT  /* REPT or WHILE loop, uses the macro fields */
 } inctype_t;
 
+/*
+ * contents of a source file (see srcfile.c)
+ */
+struct src_buf {
+  char *data;
+  long size;
+  int mapped; /* data is memory-mapped */
+};
+
+/*
+ * A token recorded in the include cache. The tokenizer state
+ * before and after the token is kept as line_buf_ptr offsets
+ * in the line (-1 for NULL), so that raw reading of the line
+ * can continue from any token.
+ */
+struct cached_token {
+  int type, len, line_off;
+  struct atom *atom;
+  long int_val;
+  int text_off;  /* offset of the text in the line, -1 if in 'str' */
+  int start_off; /* state at the start of the token */
+  int end_off;   /* state after the token */
+  char first;    /* tok_char at the start of the token */
+  char next;     /* tok_char after the token */
+  char str[4];   /* text of a short token that isn't a line view */
+};
+
+/*
+ * Cached information about one source line: recorded tokens,
+ * and where a skipped conditional block starting at the line ends
+ */
+struct line_cache {
+  struct cached_token *toks;
+  int ntoks; /* -1 if the line can't be cached */
+  int skip_to; /* line number of the ELSE/ENDIF line, 0 if not known */
+  long skip_pos; /* offset of that line in the file */
+};
+
+/*
+ * A source file in the include cache. Files stay in memory
+ * for the whole run, and the tokens of their lines are recorded
+ * when they are first scanned as an include file.
+ */
+struct src_file {
+  struct src_file *next;
+  char *path;  /* canonical path name */
+  long mtime, size;
+  struct src_buf buf;
+  struct line_cache *lines;
+  int nlines;
+  int record;  /* record the tokens of the lines */
+  int once;    /* INCLUDEONCE was used in the file */
+  char *guard; /* include guard symbol, or NULL */
+};
+
+/* include guard detection states, see check_include_guard() */
+typedef enum {
+  GUARD_NONE,   /* the file doesn't have an include guard */
+  GUARD_START,  /* nothing seen yet */
+  GUARD_IF,     /* inside 'if ~defined(symbol)' */
+  GUARD_CLOSED  /* after the ENDIF of the guard */
+} guardstate_t;
+
 /*
  * structure for include files/macros
  */
@@ -94,15 +167,28 @@ struct inc_file {
   struct inc_file *next;
   union {
     struct {
-      FILE *fp;
+      struct src_file *src;
+      char *pos; /* start of the next line */
       char *fname;
+      guardstate_t guard;
+      char *guard_name;
     } f; /* file */
     struct {
       struct symbol *sym;
-      struct macro_line *ml;
-      struct macro_arg *args;
-      int uniq_id;
-    } m; /* macro */
+      struct macro_line *ml; /* next line */
+      struct macro_line *cur; /* current line */
+      struct macro_arg *args; /* also holds argtext */
+      int args_size; /* size of the args block */
+      char *argtext;
+      int nargs;
+      int uniq; /* number for \@ */
+      struct macro_memo *memo; /* cached expansion, see token.c */
+      struct tail_call *tails; /* expansions to continue, see token.c */
+      long depth; /* expansions in the frame */
+      struct macro_line *body; /* loop body */
+      long count; /* REPT iterations left, WHILE iterations done */
+      int loop; /* KW_REPT or KW_WHILE */
+    } m; /* macro or loop */
   } v;
   inctype_t type;
   int linenum;
@@ -110,17 +196,52 @@ struct inc_file {
 };
 
 /*
- * structure to hold one macro line
+ * Parameter reference in a macro line. The line text is stored
+ * with the references removed, 'pos' is where the text goes.
+ */
+struct macro_ref {
+  int pos;
+  int slot; /* argument number (from 0), or one of the following */
+};
+
+#define MREF_UNIQ  (-1) /* \@ or \0 */
+#define MREF_NARGS (-2) /* \# */
+
+/*
+ * structure to hold one macro line, compiled
+ * by compile_macro_line() at definition time
  */
 struct macro_line {
   struct macro_line *next;
+  struct macro_line *skip_to; /* end of a skipped block starting here */
+  int skip_lines; /* number of lines to skip_to */
+  int tail; /* conditionals closed by the lines after this, see macro_tail() */
+  struct macro_ref *refs;
+  int nrefs;
+  struct line_cache lc; /* tokens of a line without references */
+  char *shown; /* ENDR line of a loop as in the source, see line_shown */
+  int len;
   char text[1];
 };
 
-/* Macro argument */
+/*
+ * A macro definition. The header with the table of line offsets,
+ * and the lines (each followed by its references) are stored one
+ * after another in one arena block, see end_macro_def().
+ */
+struct macro_def {
+  struct macro_def *next; /* all definitions, for release_tokenizer() */
+  struct macro_line *lines; /* the first line, NULL if there are none */
+  int nlines;
+  int off[1]; /* offsets of the lines from the start of the definition */
+};
+
+#define MACRO_LINE(def, n) \
+  ((struct macro_line *)((char *)(def) + (def)->off[n]))
+
+/* Macro argument, in the argument text of the expansion */
 struct macro_arg {
-  struct macro_arg *next;
-  char text[1];
+  int off, len;
 };
 
 /*
@@ -139,6 +260,29 @@ struct patch {
   patchtype_t type;
 };
 
+/* memory pool, see arena_alloc() and pool_alloc() in picasm.c */
+struct pool_free {
+  struct pool_free *next;
+};
+
+struct pool {
+  char *name;
+  int size; /* object size for pool_alloc() */
+  struct pool_free *free_list;
+  long bytes; /* memory taken from the arena */
+  struct pool *next;
+};
+
+/* arena memory is aligned for any of these */
+union arena_align {
+  long l;
+  double d;
+  void *p;
+};
+
+#define ARENA_ROUND(n) \
+  (((n) + sizeof(union arena_align)-1) & ~(sizeof(union arena_align)-1))
+
 #define PROGMEM_MAX 4096
 #define EEPROM_MAX 64
 
@@ -180,15 +324,66 @@ struct pic_type {
 };
 
 
+/* initial size of token_string, which grows for long tokens */
 #define TOKSIZE 256
 
+/*
+ * The current token. 'text' points into the source line for
+ * identifiers, local ids and strings, and to token_string for
+ * other tokens. It is not NUL-terminated, and stays valid
+ * until the tokenizer moves to another source line.
+ */
+struct token {
+  int type;
+  char *text;
+  int len;
+  struct atom *atom; /* interned name of an identifier or a local id */
+  long int_val;
+  int line_off; /* offset of an identifier in the source line */
+};
+
+/* symbol name hash (FNV-1a), also computed by the tokenizer */
+#define SYM_HASH_INIT 2166136261U
+#define SYM_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619U)
+
+/*
+ * character classes for the tokenizer (the table is in token.c)
+ */
+#define CC_SPACE   0x01 /* white space, except newline */
+#define CC_DIGIT   0x02
+#define CC_XDIGIT  0x04
+#define CC_IDSTART 0x08 /* letters, '_' and '.' */
+#define CC_IDCHAR  0x10 /* letters, digits, '_' and '.' */
+#define CC_OPSTART 0x20 /* first character of an operator */
+
+#define CHAR_CLASS(c) (char_class[(c) & 0xff])
+#define IS_SPACE(c)   (CHAR_CLASS(c) & CC_SPACE)
+#define IS_DIGIT(c)   (CHAR_CLASS(c) & CC_DIGIT)
+#define IS_XDIGIT(c)  (CHAR_CLASS(c) & CC_XDIGIT)
+#define IS_IDSTART(c) (CHAR_CLASS(c) & CC_IDSTART)
+#define IS_IDCHAR(c)  (CHAR_CLASS(c) & CC_IDCHAR)
+#define IS_OPSTART(c) (CHAR_CLASS(c) & CC_OPSTART)
+
 struct symbol {
-  struct symbol *next;
+  struct symbol *next; /* local symbol hidden by this one */
   union {
     long value;
-    struct macro_line *text;
+    struct macro_def *def;
   } v;
+  struct atom *atom;
+  char *name; /* the name in the atom */
+  int scope;  /* local block level, 0 for global symbols */
   char type;
+};
+
+/*
+ * An interned name. Each identifier is stored once, and the
+ * atom links to the symbols currently bound to the name.
+ */
+struct atom {
+  struct symbol *global; /* global symbol, or NULL */
+  struct symbol *local;  /* innermost local symbol, or NULL */
+  int len;
   char name[1];
 };
 
@@ -203,10 +398,16 @@ enum {
 #define SYMTAB_GLOBAL 0
 #define SYMTAB_LOCAL  1
 
+/* symbol table listing order */
+#define SYMSORT_NAME  1
+#define SYMSORT_VALUE 2
+
 /*
  * token codes
+ *
+ * the keyword table in token.c must list every KW_* code
+ * (this is checked at compile time and at startup)
  */
-/**/
 enum {
   TOK_INVALID,
   TOK_EOF,
@@ -244,6 +445,7 @@ enum {
   TOK_STRCONST, /* used as file name with include, and in EDATA */
 
   KW_INCLUDE,
+  KW_INCLUDEONCE,
   KW_MACRO,
   KW_ENDM,
   KW_EXITM,
@@ -267,6 +469,9 @@ enum {
   KW_LOCAL,
   KW_ENDLOCAL,
   KW_ERROR,
+  KW_REPT,
+  KW_WHILE,
+  KW_ENDR,
 
   KW_ADDLW,
   KW_ADDWF,
@@ -334,12 +539,13 @@ enum {
 /* picasm.c */
 extern struct inc_file *current_file;
 extern char *line_buf_ptr;
-extern char line_buffer[256];
+extern char *line_start, *line_end, *line_shown;
 extern int unique_id_count;
 extern int cond_nest_count;
 extern org_mode_t O_Mode;
 extern int prog_location, reg_location, edata_location, org_val;
 extern int warnlevel;
+extern int macro_depth_limit;
 extern struct patch **local_patch_list_ptr;
 extern int prog_mem_size;
 extern unsigned short list_flags;
@@ -348,9 +554,12 @@ extern pic_instr_t config_fuses;
 extern int local_level;
 
 /* token.c */
-extern int token_type, line_buf_off;
-extern char token_string[TOKSIZE];
-extern long token_int_val;
+extern const unsigned char char_class[256];
+extern struct token cur_token;
+#define token_type (cur_token.type)
+#define token_int_val (cur_token.int_val)
+#define line_buf_off (cur_token.line_off)
+extern char *token_string;
 extern int tok_char;
 extern int ifskip_mode;
 
@@ -363,7 +572,11 @@ extern int expr_error;
 
 /* picasm.c */
 void *mem_alloc(int size);
+void *mem_realloc(void *p, int size);
 #define mem_free(p) free(p)
+void *arena_alloc(struct pool *pl, int size);
+void *pool_alloc(struct pool *pl);
+void pool_free(struct pool *pl, void *p);
 void fatal_error(char *, ...), error(int, char *, ...), warning(char *, ...);
 void write_listing_line(int cond_flag);
 void gen_code(int val);
@@ -374,18 +587,43 @@ int gen_byte_c(int instr_code);
 void parse_config(void);
 
 /* token.c */
+void init_tokenizer(void);
+void release_tokenizer(void);
 void get_token(void), skip_eol(void);
+int read_skipped_line(void);
+void begin_skip(int jump), end_skip(void);
+struct token *peek_token(int n);
+void split_local_id(void);
+int get_rest_of_line(char **text);
 void expand_macro(struct symbol *sym);
+void exit_macro(void);
+void print_macro_stats(FILE *fp);
+void compile_macro_line(char *text, int len);
+struct macro_def *end_macro_def(void);
+struct macro_line *new_macro_line(char *text, int len);
+void free_macro_lines(struct macro_line *ml);
+void begin_loop(struct macro_line *body, int loop, long count);
 void begin_include(char *fname), end_include(void);
 void read_src_char(void);
 
+/* srcfile.c */
+struct src_file *open_source(char *fname, int record);
+int skip_include(char *fname);
+int skip_source(struct src_file *sf);
+void release_sources(void);
+void print_source_stats(FILE *fp);
+
 /* symtab.c */
 void init_symtab(void);
+void release_symtab(void);
 void add_local_symtab(void);
 void remove_local_symtab(void);
+struct atom *intern(char *name, int len, unsigned int h);
 struct symbol *add_symbol(char *name, int tab);
 struct symbol *lookup_symbol(char *name, int tab);
-void dump_symtab(FILE *);
+struct symbol *add_token_symbol(struct token *tok, int tab);
+struct symbol *lookup_token_symbol(struct token *tok, int tab);
+void dump_symtab(FILE *fp, int order);
 
 /* expr.c */
 long get_expression(void);
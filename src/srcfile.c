@@ -0,0 +1,593 @@
+/*
+ * picasm -- srcfile.c
+ *
+ * source file input
+ *
+ * Source files are memory-mapped where the system supports it,
+ * otherwise they are read into memory in one piece. The lexer
+ * scans the file contents directly, without copying lines.
+ *
+ * Files are kept in a cache for the whole run, keyed by the
+ * canonical path name, modification time and size, so that
+ * a file included many times is read only once.
+ *
+ * A file that uses INCLUDEONCE, or whose contents are all inside
+ * an 'if ~defined(symbol)' ... 'endif' include guard, is not even
+ * opened again when it is included with the same name while the
+ * guard symbol is defined. With another name (such as "./file.h")
+ * it is found in the cache by its path, and skipped there.
+ *
+ * When compiled with PREFETCH defined, each newly read file is
+ * scanned for include directives, and the named files are read
+ * by a background thread so that they are usually in memory by
+ * the time they are needed. Files whose include is never reached
+ * (in skipped conditionals, for example) are just not used.
+ * This needs POSIX threads.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "picasm.h"
+
+#if defined(unix) || defined(__unix) || defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#define HAVE_REALPATH
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef PREFETCH
+#include <pthread.h>
+#endif
+
+static struct src_file *src_cache;
+static struct src_file *old_sources; /* changed files, still in use */
+static int cache_hits, cache_misses, include_skips;
+
+/* include file names as written in the source */
+#define SRC_NAME_HASH 61
+
+struct src_name {
+  struct src_name *next;
+  struct src_file *src;
+  char name[1];
+};
+
+static struct src_name *src_names[SRC_NAME_HASH];
+
+static struct src_name **
+find_src_name(char *fname)
+{
+  struct src_name **np;
+  unsigned int h;
+  char *cp;
+
+  h = SYM_HASH_INIT;
+  for(cp = fname; *cp != '\0'; cp++)
+    h = SYM_HASH_STEP(h, *cp);
+
+  for(np = &src_names[h % SRC_NAME_HASH]; *np != NULL; np = &(*np)->next) {
+    if(strcmp((*np)->name, fname) == 0)
+      break;
+  }
+  return np;
+}
+
+/*
+ * Remember which file was opened with the name 'fname'
+ */
+static void
+add_src_name(char *fname, struct src_file *sf)
+{
+  struct src_name **np, *n;
+
+  np = find_src_name(fname);
+  if((n = *np) == NULL) {
+    n = mem_alloc(sizeof(struct src_name) + strlen(fname));
+    strcpy(n->name, fname);
+    n->next = NULL;
+    *np = n;
+  }
+  n->src = sf;
+}
+
+/* initial buffer size for reading files without mmap() */
+#define READ_CHUNK 8192
+
+/*
+ * Read a whole file into memory using stdio.
+ * The file is opened in text mode, so line ends are
+ * converted on systems that need that.
+ */
+static int
+read_whole_file(char *fname, struct src_buf *sb)
+{
+  FILE *fp;
+  char *data;
+  long size, alloc;
+  size_t n;
+
+  if((fp = fopen(fname, "r")) == NULL)
+    return FAIL;
+
+  alloc = READ_CHUNK;
+  data = mem_alloc(alloc);
+  size = 0;
+
+  while((n = fread(data+size, 1, alloc-size, fp)) > 0) {
+    size += n;
+    if(size == alloc) {
+      alloc *= 2;
+      data = mem_realloc(data, alloc);
+    }
+  }
+  fclose(fp);
+
+  sb->data = data;
+  sb->size = size;
+  sb->mapped = 0;
+  return OK;
+}
+
+/*
+ * Get the contents of a source file.
+ * returns OK, or FAIL if the file can't be opened
+ */
+static int
+read_source(char *fname, struct src_buf *sb)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  void *p;
+  int fd;
+
+  if((fd = open(fname, O_RDONLY)) >= 0) {
+    /* empty files and non-regular files are read normally */
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED) {
+	close(fd);
+	sb->data = p;
+	sb->size = st.st_size;
+	sb->mapped = 1;
+	return OK;
+      }
+    }
+    close(fd);
+  }
+#endif
+
+  return read_whole_file(fname, sb);
+}
+
+/*
+ * Free the contents of a source file
+ */
+static void
+free_source_buf(struct src_buf *sb)
+{
+#ifdef HAVE_MMAP
+  if(sb->mapped) {
+    munmap(sb->data, sb->size);
+    return;
+  }
+#endif
+  mem_free(sb->data);
+}
+
+#ifdef PREFETCH
+
+/* prefetch request states */
+#define PF_QUEUED  0 /* waiting for the prefetch thread */
+#define PF_READING 1 /* being read by the prefetch thread */
+#define PF_DONE    2 /* contents in 'buf' */
+#define PF_FAILED  3 /* can't be read */
+#define PF_TAKEN   4 /* used, or read directly by open_source() */
+
+struct prefetch {
+  struct prefetch *next;
+  int state;
+  long mtime, size;
+  struct src_buf buf;
+  char name[1];
+};
+
+static struct prefetch *pf_list; /* in queue order */
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pf_thread;
+static int pf_running, pf_used, pf_requests;
+static volatile char pf_touch;
+
+/*
+ * The prefetch thread. Reads the queued files in order,
+ * touching the pages of memory-mapped files so that they
+ * are read from the disk.
+ */
+static void *
+prefetch_thread(void *arg)
+{
+  struct prefetch *pf;
+  struct stat st;
+  long i;
+
+  pthread_mutex_lock(&pf_lock);
+  for(;;) {
+    for(pf = pf_list; pf != NULL && pf->state != PF_QUEUED; pf = pf->next)
+      ;
+    if(pf == NULL) {
+      pthread_cond_wait(&pf_cond, &pf_lock);
+      continue;
+    }
+    pf->state = PF_READING;
+    pthread_mutex_unlock(&pf_lock);
+
+    if(stat(pf->name, &st) == 0 && read_source(pf->name, &pf->buf) == OK) {
+      for(i = 0; i < pf->buf.size; i += 512)
+	pf_touch += pf->buf.data[i];
+      pf->mtime = (long)st.st_mtime;
+      pf->size = (long)st.st_size;
+      pthread_mutex_lock(&pf_lock);
+      pf->state = PF_DONE;
+    } else {
+      pthread_mutex_lock(&pf_lock);
+      pf->state = PF_FAILED;
+    }
+    pthread_cond_broadcast(&pf_cond);
+  }
+  return arg;
+}
+
+/*
+ * Queue the file 'name' (length 'len') for prefetching,
+ * unless it has been opened or queued already.
+ */
+static void
+queue_prefetch(char *name, int len)
+{
+  struct prefetch *pf, **pfp;
+
+  pf = mem_alloc(sizeof(struct prefetch) + len);
+  memcpy(pf->name, name, len);
+  pf->name[len] = '\0';
+  pf->next = NULL;
+  pf->state = PF_QUEUED;
+  if(*find_src_name(pf->name) != NULL) {
+    mem_free(pf);
+    return;
+  }
+
+  pthread_mutex_lock(&pf_lock);
+  for(pfp = &pf_list; *pfp != NULL; pfp = &(*pfp)->next) {
+    if(strcmp((*pfp)->name, pf->name) == 0) {
+      pthread_mutex_unlock(&pf_lock);
+      mem_free(pf);
+      return;
+    }
+  }
+  *pfp = pf;
+  pf_requests++;
+
+  if(!pf_running) {
+    if(pthread_create(&pf_thread, NULL, prefetch_thread, NULL) != 0)
+      pf->state = PF_FAILED; /* read when needed */
+    else {
+      pthread_detach(pf_thread);
+      pf_running = 1;
+    }
+  }
+  pthread_cond_broadcast(&pf_cond);
+  pthread_mutex_unlock(&pf_lock);
+}
+
+/* check for the word 'include' at p */
+#define IS_INCLUDE(p, end) \
+  ((end)-(p) > 8 && ((p)[0] | 0x20) == 'i' && ((p)[1] | 0x20) == 'n' \
+   && ((p)[2] | 0x20) == 'c' && ((p)[3] | 0x20) == 'l' \
+   && ((p)[4] | 0x20) == 'u' && ((p)[5] | 0x20) == 'd' \
+   && ((p)[6] | 0x20) == 'e' && IS_SPACE((p)[7]))
+
+/*
+ * Scan the contents of a file for include directives
+ * ('include "name"', with an optional label)
+ */
+static void
+scan_includes(struct src_buf *sb)
+{
+  char *p, *q, *end;
+
+  end = sb->data + sb->size;
+  for(p = sb->data; p < end; p++) {
+    if(IS_IDSTART(*p) && !IS_INCLUDE(p, end)) { /* label */
+      while(p < end && (IS_IDCHAR(*p) || *p == ':'))
+	p++;
+    }
+    while(p < end && IS_SPACE(*p))
+      p++;
+
+    if(IS_INCLUDE(p, end)) {
+      for(p += 8; p < end && IS_SPACE(*p); p++)
+	;
+      if(p < end && *p == '"') {
+	for(q = ++p; q < end && *q != '"' && *q != '\n'; q++)
+	  ;
+	if(q < end && *q == '"' && q > p)
+	  queue_prefetch(p, q-p);
+	p = q;
+      }
+    }
+
+    if(p < end && *p != '\n' && (p = memchr(p, '\n', end-p)) == NULL)
+      break;
+  }
+}
+
+/*
+ * Get the contents of a file from the prefetch thread.
+ * returns OK, or FAIL if the file must be read directly
+ */
+static int
+take_prefetched(char *fname, struct stat *st, struct src_buf *sb)
+{
+  struct prefetch *pf;
+  int ret;
+
+  ret = FAIL;
+  pthread_mutex_lock(&pf_lock);
+  for(pf = pf_list; pf != NULL && strcmp(pf->name, fname) != 0; pf = pf->next)
+    ;
+  if(pf != NULL) {
+    while(pf->state == PF_READING)
+      pthread_cond_wait(&pf_cond, &pf_lock);
+
+    /* the file may have changed after it was read */
+    if(pf->state == PF_DONE && pf->mtime == (long)st->st_mtime
+       && pf->size == (long)st->st_size) {
+      *sb = pf->buf;
+      pf_used++;
+      ret = OK;
+    } else if(pf->state == PF_DONE) {
+      free_source_buf(&pf->buf);
+    }
+    pf->buf.data = NULL;
+    pf->state = PF_TAKEN;
+  }
+  pthread_mutex_unlock(&pf_lock);
+  return ret;
+}
+
+#endif /* PREFETCH */
+
+/*
+ * Set up the line cache of a file: one line_cache for each
+ * line, including a last line without newline. The main file
+ * is read only once, so it doesn't get one unless it is
+ * included later.
+ */
+static void
+init_line_cache(struct src_file *sf)
+{
+  char *p, *end;
+  int n;
+
+  n = 0;
+  end = sf->buf.data + sf->buf.size;
+  for(p = sf->buf.data; p < end && (p = memchr(p, '\n', end-p)) != NULL; p++)
+    n++;
+  if(sf->buf.size > 0 && end[-1] != '\n')
+    n++;
+  sf->nlines = n;
+  sf->lines = mem_alloc(n > 0 ? n*sizeof(struct line_cache) : 1);
+  memset(sf->lines, 0, n*sizeof(struct line_cache));
+}
+
+/*
+ * Open a source file through the cache. 'record' asks the
+ * tokenizer to record the tokens of the file's lines.
+ * returns NULL if the file can't be opened
+ */
+struct src_file *
+open_source(char *fname, int record)
+{
+  struct src_file *sf, **sfp;
+  struct stat st;
+  char *path;
+
+  if(stat(fname, &st) != 0)
+    return NULL;
+
+#ifdef HAVE_REALPATH
+  if((path = realpath(fname, NULL)) == NULL)
+    return NULL;
+#else
+  path = mem_alloc(strlen(fname)+1);
+  strcpy(path, fname);
+#endif
+
+  for(sfp = &src_cache; (sf = *sfp) != NULL; sfp = &sf->next) {
+    if(strcmp(sf->path, path) == 0)
+      break;
+  }
+
+  if(sf != NULL) {
+    if(sf->mtime == (long)st.st_mtime && sf->size == (long)st.st_size) {
+      free(path);
+      if(record && sf->lines == NULL)
+	init_line_cache(sf);
+      sf->record |= record;
+      cache_hits++;
+      add_src_name(fname, sf);
+      return sf;
+    }
+
+    /*
+     * The file has changed. The old contents may still be
+     * in use, so they are only dropped from the cache.
+     */
+    *sfp = sf->next;
+    sf->next = old_sources;
+    old_sources = sf;
+  }
+
+  sf = mem_alloc(sizeof(struct src_file));
+#ifdef PREFETCH
+  if(take_prefetched(fname, &st, &sf->buf) != OK)
+#endif
+  if(read_source(fname, &sf->buf) != OK) {
+    free(path);
+    mem_free(sf);
+    return NULL;
+  }
+  cache_misses++;
+
+  sf->path = path;
+  sf->mtime = (long)st.st_mtime;
+  sf->size = (long)st.st_size;
+  sf->record = record;
+  sf->once = 0;
+  sf->guard = NULL;
+
+  sf->lines = NULL;
+  sf->nlines = 0;
+  if(record)
+    init_line_cache(sf);
+
+  sf->next = src_cache;
+  src_cache = sf;
+  add_src_name(fname, sf);
+#ifdef PREFETCH
+  scan_includes(&sf->buf);
+#endif
+  return sf;
+}
+
+/*
+ * Check if an include of the file 'sf' can be skipped, because
+ * the file has been included before and either used INCLUDEONCE
+ * or has an include guard whose symbol is now defined.
+ */
+int
+skip_source(struct src_file *sf)
+{
+  struct symbol *sym;
+
+  if(!sf->once) {
+    if(sf->guard == NULL
+       || (sym = lookup_symbol(sf->guard, SYMTAB_GLOBAL)) == NULL
+       || (sym->type != SYM_DEFINED && sym->type != SYM_SET))
+      return 0;
+  }
+
+  include_skips++;
+  return 1;
+}
+
+/*
+ * Check if an include of 'fname' can be skipped without
+ * opening the file, when it was included with the same name
+ */
+int
+skip_include(char *fname)
+{
+  struct src_name *n;
+
+  if((n = *find_src_name(fname)) == NULL)
+    return 0;
+  return skip_source(n->src);
+}
+
+/*
+ * Print include cache statistics
+ */
+void
+print_source_stats(FILE *fp)
+{
+  fprintf(fp, "Include cache: %d hit%s, %d miss%s, %d skipped include%s\n",
+	  cache_hits, cache_hits == 1 ? "" : "s",
+	  cache_misses, cache_misses == 1 ? "" : "es",
+	  include_skips, include_skips == 1 ? "" : "s");
+#ifdef PREFETCH
+  fprintf(fp, "Prefetch: %d of %d file%s used\n",
+	  pf_used, pf_requests, pf_requests == 1 ? "" : "s");
+#endif
+}
+
+/*
+ * Free a file of the include cache
+ */
+static void
+free_source(struct src_file *sf)
+{
+  int i;
+
+  for(i = 0; i < sf->nlines; i++) {
+    if(sf->lines[i].ntoks > 0)
+      mem_free(sf->lines[i].toks);
+  }
+  mem_free(sf->lines);
+  free_source_buf(&sf->buf);
+  free(sf->path);
+  if(sf->guard != NULL)
+    free(sf->guard);
+  mem_free(sf);
+}
+
+/*
+ * Empty the include cache at the end of assembly
+ */
+void
+release_sources(void)
+{
+  struct src_file *sf;
+  struct src_name *n;
+  int i;
+#ifdef PREFETCH
+  struct prefetch *pf;
+
+  /* wait for the file being read, and drop the rest */
+  pthread_mutex_lock(&pf_lock);
+  for(;;) {
+    for(pf = pf_list; pf != NULL && pf->state != PF_READING; pf = pf->next) {
+      if(pf->state == PF_QUEUED)
+	pf->state = PF_TAKEN;
+    }
+    if(pf == NULL)
+      break;
+    pthread_cond_wait(&pf_cond, &pf_lock);
+  }
+  while((pf = pf_list) != NULL) {
+    pf_list = pf->next;
+    if(pf->state == PF_DONE)
+      free_source_buf(&pf->buf);
+    mem_free(pf);
+  }
+  pf_used = pf_requests = 0;
+  pthread_mutex_unlock(&pf_lock);
+#endif
+
+  while((sf = src_cache) != NULL) {
+    src_cache = sf->next;
+    free_source(sf);
+  }
+  while((sf = old_sources) != NULL) {
+    old_sources = sf->next;
+    free_source(sf);
+  }
+
+  for(i = 0; i < SRC_NAME_HASH; i++) {
+    while((n = src_names[i]) != NULL) {
+      src_names[i] = n->next;
+      mem_free(n);
+    }
+  }
+  cache_hits = cache_misses = include_skips = 0;
+}
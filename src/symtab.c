@@ -13,33 +13,147 @@
 
 #include "picasm.h"
 
-#define HASH_TABLE_SIZE 127
+/*
+ * Names are interned: each identifier is stored once as an atom,
+ * and the tokenizer gives each identifier token its atom. The atom
+ * links to the global symbol and to the innermost local symbol with
+ * that name, so finding a symbol doesn't need a table lookup.
+ *
+ * The atom table uses open addressing with linear probing. The table
+ * size is a power of two, and the table is doubled when it gets half
+ * full. Each slot keeps the hash value of its atom, so names are
+ * compared only when the hash values match.
+ */
+#define ATOM_TABLE_SIZE 1024
 
-typedef struct symbol *symtable[HASH_TABLE_SIZE];
+struct atom_slot {
+  unsigned int hash;
+  struct atom *atom;
+};
+
+static struct atom_slot *atom_table;
+static unsigned int atom_mask; /* table size - 1 */
+static unsigned int atom_count;
+static struct pool atom_pool = { "names" };
+static struct pool symbol_pool = { "global symbols" };
+static struct pool local_pool = { "local symbols", sizeof(struct symbol) };
 
-/* structure for list of local symbol tables */
+/*
+ * Local symbols are pushed on a stack, and ENDLOCAL removes the
+ * ones above the stack position saved when the block started.
+ * A local symbol hides the one with the same name in an outer
+ * block, and the outer one is linked back to the atom when the
+ * inner one is removed.
+ */
 struct localtab {
   struct localtab *next;
   struct patch *patch_list;
-  symtable table;
+  int base; /* local symbol stack position at the start of the block */
 };
 
-static symtable global_symbol_table;
 static struct localtab *local_table_list;
+static struct localtab *free_localtabs; /* for reuse */
+static struct symbol **local_stack;
+static int local_count, local_stack_size;
 
 /*
  * Compute a hash value from a string
+ * (the tokenizer computes the same value for identifiers)
  */
 static unsigned int
 hash(char *str)
 {
-  unsigned int h, a;
+  unsigned int h;
+
+  h = SYM_HASH_INIT;
+  while(*str != '\0') {
+    h = SYM_HASH_STEP(h, *str);
+    str++;
+  }
+  return h;
+}
+
+/*
+ * Set up an empty atom table of 'size' slots
+ */
+static void
+init_atom_table(unsigned int size)
+{
+  unsigned int i;
+
+  atom_table = mem_alloc(size*sizeof(struct atom_slot));
+  for(i = 0; i < size; i++)
+    atom_table[i].atom = NULL;
+  atom_mask = size-1;
+}
+
+/*
+ * Double the size of the atom table
+ */
+static void
+grow_atom_table(void)
+{
+  struct atom_slot *old, *sp;
+  unsigned int i, n, size;
+
+  old = atom_table;
+  size = atom_mask+1;
+  init_atom_table(2*size);
+  for(sp = old, n = size; n-- > 0; sp++) {
+    if(sp->atom != NULL) {
+      for(i = sp->hash & atom_mask; atom_table[i].atom != NULL;
+	  i = (i+1) & atom_mask)
+	;
+      atom_table[i] = *sp;
+    }
+  }
+  mem_free(old);
+}
 
-  h = 0;
-  while((a = *str++) != '\0') {
-    h = 17*h + a;
+/*
+ * Find the slot of the atom for a name of 'len' characters
+ * with a hash value 'h', or the empty slot where it would go
+ */
+static struct atom_slot *
+find_atom_slot(char *name, int len, unsigned int h)
+{
+  struct atom_slot *sp;
+  unsigned int i;
+
+  for(i = h & atom_mask; (sp = &atom_table[i])->atom != NULL;
+      i = (i+1) & atom_mask) {
+    if(sp->hash == h && sp->atom->len == len
+       && memcmp(sp->atom->name, name, len) == 0)
+      break;
   }
-  return h % HASH_TABLE_SIZE;
+  return sp;
+}
+
+/*
+ * Find the atom for a name of 'len' characters with
+ * a hash value 'h', or add a new one
+ */
+struct atom *
+intern(char *name, int len, unsigned int h)
+{
+  struct atom_slot *sp;
+  struct atom *a;
+
+  sp = find_atom_slot(name, len, h);
+  if(sp->atom != NULL)
+    return sp->atom;
+
+  a = arena_alloc(&atom_pool, sizeof(struct atom) + len);
+  a->global = a->local = NULL;
+  a->len = len;
+  memcpy(a->name, name, len);
+  a->name[len] = '\0';
+
+  sp->hash = h;
+  sp->atom = a;
+  if(2*(++atom_count) > atom_mask+1)
+    grow_atom_table();
+  return a;
 }
 
 /*
@@ -48,14 +162,36 @@ hash(char *str)
 void
 init_symtab(void)
 {
-  struct symbol **sym;
-  int n;
+  init_atom_table(ATOM_TABLE_SIZE);
+  atom_count = 0;
+  local_table_list = NULL;
+  local_count = 0;
+}
+
+/*
+ * Free the symbol tables at the end of assembly.
+ * The atoms and symbols are in the arena.
+ */
+void
+release_symtab(void)
+{
+  struct localtab *tab;
 
-  for(sym = global_symbol_table, n = HASH_TABLE_SIZE;
-      n-- > 0; *sym++ = NULL)
-    ;
+  mem_free(atom_table);
+  atom_table = NULL;
+  atom_mask = atom_count = 0;
 
-  local_table_list = NULL;
+  while((tab = local_table_list) != NULL) {
+    local_table_list = tab->next;
+    mem_free(tab);
+  }
+  while((tab = free_localtabs) != NULL) {
+    free_localtabs = tab->next;
+    mem_free(tab);
+  }
+  mem_free(local_stack);
+  local_stack = NULL;
+  local_count = local_stack_size = 0;
 }
 
 /*
@@ -64,15 +200,13 @@ init_symtab(void)
 void add_local_symtab(void)
 {
   struct localtab *tab;
-  struct symbol **symp;
-  int n;
 
-  tab = mem_alloc(sizeof(struct localtab));
-
-  for(symp = &tab->table[0], n = HASH_TABLE_SIZE;
-      n-- > 0; *symp++ = NULL)
-    ;
+  if((tab = free_localtabs) != NULL)
+    free_localtabs = tab->next;
+  else
+    tab = mem_alloc(sizeof(struct localtab));
 
+  tab->base = local_count;
   tab->patch_list = NULL;
   local_patch_list_ptr = &tab->patch_list;
   tab->next = local_table_list;
@@ -86,108 +220,172 @@ void add_local_symtab(void)
  */
 void remove_local_symtab(void)
 {
-  int i;
   struct localtab *tab;
-  struct symbol *sym, *sym2;
+  struct symbol *sym;
 
   tab = local_table_list;
 
-  for(i = 0; i < HASH_TABLE_SIZE; i++) {
-    for(sym = tab->table[i]; sym != NULL; sym = sym2) {
-      sym2 = sym->next;
-      mem_free(sym);
-    }
+  while(local_count > tab->base) {
+    sym = local_stack[--local_count];
+    sym->atom->local = sym->next;
+    pool_free(&local_pool, sym);
   }
 
   local_table_list = tab->next;
   if(local_table_list != NULL)
     local_patch_list_ptr = &local_table_list->patch_list;
 
-  mem_free(tab);
+  tab->next = free_localtabs;
+  free_localtabs = tab;
   local_level--;
 }
 
 /*
- * Add a new symbol to the symbol table
+ * Add a symbol for an atom to the symbol table
  */
-struct symbol *
-add_symbol(char *name, int tab)
+static struct symbol *
+new_symbol(struct atom *a, int tab)
 {
   struct symbol *sym;
-  symtable *table;
-  int i;
 
-  table = (tab == SYMTAB_LOCAL ? &local_table_list->table :
-	    &global_symbol_table);
+  if(tab == SYMTAB_LOCAL) {
+    sym = pool_alloc(&local_pool);
+    sym->scope = local_level;
+    sym->next = a->local; /* the symbol of an outer block */
+    a->local = sym;
 
-  if((sym = mem_alloc(sizeof(struct symbol) + strlen(name))) == NULL)
-    return NULL;
-
-  i = hash(name);
-  sym->next = (*table)[i];
-  (*table)[i] = sym;
-
-  strcpy(sym->name, name);
+    if(local_count == local_stack_size) {
+      local_stack_size = (local_stack_size == 0 ? 64 : 2*local_stack_size);
+      local_stack = mem_realloc(local_stack,
+				local_stack_size*sizeof(struct symbol *));
+    }
+    local_stack[local_count++] = sym;
+  } else {
+    /* global symbols are kept until the end of assembly */
+    sym = arena_alloc(&symbol_pool, sizeof(struct symbol));
+    sym->scope = 0;
+    sym->next = NULL;
+    a->global = sym;
+  }
+  sym->atom = a;
+  sym->name = a->name;
 
 /* the caller must fill the value, type and flags fields */
 
   return sym;
 }
 
+/*
+ * Find the symbol for an atom
+ */
+static struct symbol *
+find_symbol(struct atom *a, int tab)
+{
+  if(tab == SYMTAB_LOCAL) {
+    /* only the innermost block is visible */
+    if(a->local != NULL && a->local->scope == local_level)
+      return a->local;
+    return NULL;
+  }
+  return a->global;
+}
+
+/*
+ * Add a new symbol to the symbol table
+ */
+struct symbol *
+add_symbol(char *name, int tab)
+{
+  return new_symbol(intern(name, strlen(name), hash(name)), tab);
+}
+
 /*
  * Try to find a symbol from the symbol table
+ * (a name that has no atom has no symbol either)
  */
 struct symbol *
 lookup_symbol(char *name, int tab)
 {
-  symtable *table;
-  struct symbol *sym;
-  int i;
+  struct atom_slot *sp;
 
-  table = (tab == SYMTAB_LOCAL ? &local_table_list->table :
-	    &global_symbol_table);
+  sp = find_atom_slot(name, strlen(name), hash(name));
+  return (sp->atom != NULL ? find_symbol(sp->atom, tab) : NULL);
+}
 
-  i = hash(name);
+/*
+ * Add a symbol named by an identifier token
+ * (the tokenizer has interned the name)
+ */
+struct symbol *
+add_token_symbol(struct token *tok, int tab)
+{
+  return new_symbol(tok->atom, tab);
+}
 
-  for(sym = (*table)[i]; sym != NULL; sym = sym->next) {
-    if(strcmp(sym->name, name) == 0)
-      return sym;
-  }
+/*
+ * Find a symbol named by an identifier token
+ */
+struct symbol *
+lookup_token_symbol(struct token *tok, int tab)
+{
+  return find_symbol(tok->atom, tab);
+}
 
-  return NULL;
-}
-
-/*
- * symbol table output for listing (global symbols only)
- */
-void dump_symtab(FILE *fp)
-{
-  int i;
-  struct symbol *sym, *nsym, *s0, *s1;
-  struct symbol *syms = NULL;
-  
-  for(i = 0; i < HASH_TABLE_SIZE; i++) {
-    for(sym = global_symbol_table[i]; sym != NULL; sym = nsym) {
-      nsym = sym->next;
-      
-      for(s0 = NULL, s1 = syms; s1 != NULL; s0 = s1, s1 = s1->next) {
-        if(strcmp(s1->name, sym->name) > 0)
-          break;
-      }
-      
-      if(s0 == NULL) {
-        sym->next = syms;
-        syms = sym;
-      } else {
-        sym->next = s0->next;
-        s0->next = sym;
-      }
-    }
+/*
+ * Compare symbols by name
+ */
+static int
+compare_names(const void *p1, const void *p2)
+{
+  return strcmp((*(struct symbol **)p1)->name, (*(struct symbol **)p2)->name);
+}
+
+/*
+ * Compare symbols by value. Symbols without a value
+ * (macros and undefined symbols) come last, and symbols
+ * with the same value are ordered by name
+ */
+static int
+compare_values(const void *p1, const void *p2)
+{
+  struct symbol *s1, *s2;
+  int v1, v2;
+
+  s1 = *(struct symbol **)p1;
+  s2 = *(struct symbol **)p2;
+  v1 = (s1->type == SYM_DEFINED);
+  v2 = (s2->type == SYM_DEFINED);
+  if(v1 != v2)
+    return v2-v1;
+  if(v1 && s1->v.value != s2->v.value)
+    return (s1->v.value < s2->v.value ? -1 : 1);
+  return strcmp(s1->name, s2->name);
+}
+
+/*
+ * symbol table output for listing (global symbols only),
+ * sorted by name or by value (SYMSORT_NAME/SYMSORT_VALUE).
+ * The symbol table is not changed, so this can be
+ * called at any time during assembly.
+ */
+void dump_symtab(FILE *fp, int order)
+{
+  unsigned int i, n;
+  struct symbol *sym, **syms;
+
+  syms = mem_alloc((atom_count+1)*sizeof(struct symbol *));
+  for(i = n = 0; i <= atom_mask; i++) {
+    if(atom_table[i].atom != NULL
+       && (sym = atom_table[i].atom->global) != NULL)
+      syms[n++] = sym;
   }
+  qsort(syms, n, sizeof(struct symbol *),
+	(order == SYMSORT_VALUE ? compare_values : compare_names));
 
   fputs("\n\nSymbol Table:\nname                 decimal    hex\n", fp);
 
-  for(sym = syms; sym != NULL; sym = sym->next) {
+  for(i = 0; i < n; i++) {
+      sym = syms[i];
       if(sym->type == SYM_MACRO)
         fprintf(fp, "%-20s   MACRO\n", sym->name);
       else if(sym->type == SYM_FORWARD)
@@ -198,4 +396,5 @@ void dump_symtab(FILE *fp)
       else
         fprintf(fp, "%-20s   ???\n", sym->name);
   }
+  mem_free(syms);
 }
@@ -10,92 +10,355 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 
 #include "picasm.h"
 
 /*
  * keyword table for tokenizer
  *
- * this must be in sync with the token definitions in picasm.h
- */
-static char Keyword_Table[] = {
-  "include\0"
-  "macro\0"
-  "endm\0"
-  "exitm\0"
-  "if\0"
-  "else\0"
-  "endif\0"
-  "equ\0"
-  "set\0"
-  "end\0"
-  "org\0"
-  "ds\0"
-  "edata\0"
-  "config\0"
-  "picid\0"
-  "device\0"
-  "defined\0"
-  "streq\0"
-  "isstr\0"
-  "chrval\0"
-  "opt\0"
-  "local\0"
-  "endlocal\0"
-  "error\0"
-	    
+ * Each entry carries its own token code, so the order does not matter.
+ * The table size is checked against the KW_* token range at compile
+ * time, and init_tokenizer() checks that every keyword token appears
+ * exactly once.
+ */
+struct keyword {
+  char *name;
+  int token;
+  struct keyword *next; /* next keyword in the same index slot */
+};
+
+static struct keyword Keyword_Table[] = {
+  { "include", KW_INCLUDE },
+  { "includeonce", KW_INCLUDEONCE },
+  { "macro", KW_MACRO },
+  { "endm", KW_ENDM },
+  { "exitm", KW_EXITM },
+  { "if", KW_IF },
+  { "else", KW_ELSE },
+  { "endif", KW_ENDIF },
+  { "equ", KW_EQU },
+  { "set", KW_SET },
+  { "end", KW_END },
+  { "org", KW_ORG },
+  { "ds", KW_DS },
+  { "edata", KW_EDATA },
+  { "config", KW_CONFIG },
+  { "picid", KW_PICID },
+  { "device", KW_DEVICE },
+  { "defined", KW_DEFINED },
+  { "streq", KW_STREQ },
+  { "isstr", KW_ISSTR },
+  { "chrval", KW_CHRVAL },
+  { "opt", KW_OPT },
+  { "local", KW_LOCAL },
+  { "endlocal", KW_ENDLOCAL },
+  { "error", KW_ERROR },
+  { "rept", KW_REPT },
+  { "while", KW_WHILE },
+  { "endr", KW_ENDR },
+
 /* 12/14-bit PIC instruction mnemonics */
-  "addlw\0"
-  "addwf\0"
-  "andlw\0"
-  "andwf\0"
-  "bcf\0"
-  "bsf\0"
-  "btfsc\0"
-  "btfss\0"
-  "call\0"
-  "clrf\0"
-  "clrw\0"
-  "clrwdt\0"
-  "comf\0"
-  "decf\0"
-  "decfsz\0"
-  "goto\0"
-  "incf\0"
-  "incfsz\0"
-  "iorlw\0"
-  "iorwf\0"
-  "movlw\0"
-  "movf\0"
-  "movwf\0"
-  "nop\0"
-  "option\0"
-  "retfie\0"
-  "retlw\0"
-  "return\0"
-  "rlf\0"
-  "rrf\0"
-  "sleep\0"
-  "sublw\0"
-  "subwf\0"
-  "swapf\0"
-  "tris\0"
-  "xorlw\0"
-  "xorwf\0"
-
-  "\0"
+  { "addlw", KW_ADDLW },
+  { "addwf", KW_ADDWF },
+  { "andlw", KW_ANDLW },
+  { "andwf", KW_ANDWF },
+  { "bcf", KW_BCF },
+  { "bsf", KW_BSF },
+  { "btfsc", KW_BTFSC },
+  { "btfss", KW_BTFSS },
+  { "call", KW_CALL },
+  { "clrf", KW_CLRF },
+  { "clrw", KW_CLRW },
+  { "clrwdt", KW_CLRWDT },
+  { "comf", KW_COMF },
+  { "decf", KW_DECF },
+  { "decfsz", KW_DECFSZ },
+  { "goto", KW_GOTO },
+  { "incf", KW_INCF },
+  { "incfsz", KW_INCFSZ },
+  { "iorlw", KW_IORLW },
+  { "iorwf", KW_IORWF },
+  { "movlw", KW_MOVLW },
+  { "movf", KW_MOVF },
+  { "movwf", KW_MOVWF },
+  { "nop", KW_NOP },
+  { "option", KW_OPTION },
+  { "retfie", KW_RETFIE },
+  { "retlw", KW_RETLW },
+  { "return", KW_RETURN },
+  { "rlf", KW_RLF },
+  { "rrf", KW_RRF },
+  { "sleep", KW_SLEEP },
+  { "sublw", KW_SUBLW },
+  { "subwf", KW_SUBWF },
+  { "swapf", KW_SWAPF },
+  { "tris", KW_TRIS },
+  { "xorlw", KW_XORLW },
+  { "xorwf", KW_XORWF },
+};
+
+#define KW_TABLE_SIZE ((int)(sizeof(Keyword_Table)/sizeof(Keyword_Table[0])))
+
+/* fails to compile if the table and the token definitions differ in size */
+typedef char kw_table_size_check[KW_TABLE_SIZE == NUM_KEYWORDS ? 1 : -1];
+
+/*
+ * Keyword index, by first letter and length. Identifiers that
+ * can't be keywords are rejected without any string compares,
+ * and most slots hold only one keyword.
+ */
+#define KW_MAXLEN 11
+
+static struct keyword *kw_index[26][KW_MAXLEN+1];
+
+/*
+ * Character classes for the tokenizer (see CC_* in picasm.h).
+ * Only ASCII characters are classified, so the results
+ * don't depend on the locale.
+ */
+#define S CC_SPACE
+#define D (CC_DIGIT|CC_XDIGIT|CC_IDCHAR)
+#define X (CC_XDIGIT|CC_IDSTART|CC_IDCHAR)
+#define L (CC_IDSTART|CC_IDCHAR)
+#define O CC_OPSTART
+
+const unsigned char char_class[256] = {
+  /* ^@ ^A ^B ^C ^D ^E ^F ^G ^H \t \n \v \f \r ^N ^O */
+     0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, S, S, S, 0, 0,
+  /* ^P ^Q ^R ^S ^T ^U ^V ^W ^X ^Y ^Z ^[ ^\ ^] ^^ ^_ */
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* sp !  "  #  $  %  &  '  (  )  *  +  ,  -  .  / */
+     S, O, 0, 0, O, O, O, 0, O, O, O, O, O, O, L, O,
+  /* 0  1  2  3  4  5  6  7  8  9  :  ;  <  =  >  ? */
+     D, D, D, D, D, D, D, D, D, D, O, 0, O, O, O, 0,
+  /* @  A  B  C  D  E  F  G  H  I  J  K  L  M  N  O */
+     0, X, X, X, X, X, X, L, L, L, L, L, L, L, L, L,
+  /* P  Q  R  S  T  U  V  W  X  Y  Z  [  \  ]  ^  _ */
+     L, L, L, L, L, L, L, L, L, L, L, O, O, O, O, L,
+  /* `  a  b  c  d  e  f  g  h  i  j  k  l  m  n  o */
+     0, X, X, X, X, X, X, L, L, L, L, L, L, L, L, L,
+  /* p  q  r  s  t  u  v  w  x  y  z  {  |  }  ~  ^? */
+     L, L, L, L, L, L, L, L, L, L, L, 0, O, 0, O, 0,
+  /* 0x80..0xff: no class */
 };
 
+#undef S
+#undef D
+#undef X
+#undef L
+#undef O
+
 /* tokenizer definitions & variables */
 int tok_char;
 
-int token_type, line_buf_off;
-char token_string[TOKSIZE];
-long token_int_val;
+struct token cur_token;
+char *token_string; /* NUL-terminated copy of the token text */
+static int token_string_size;
+
+/* tokenizer state at the start of the last scanned token */
+static char *tok_start_ptr;
+static int tok_start_char;
+
+/*
+ * Tokens scanned ahead by peek_token(). They are all on the
+ * current line. 'pos' and 'first' are the tokenizer state at the
+ * start of each token, so that unpeek_tokens() can go back to the
+ * first one when the line must be read as raw characters.
+ */
+#define PEEK_MAX 6
+
+struct peeked {
+  struct token tok;
+  char *pos;
+  int first;
+  char str[4]; /* token_string of a token that isn't a line view */
+};
+
+static struct peeked peek_queue[PEEK_MAX];
+static int peek_first, peek_count;
+
+static void unpeek_tokens(void);
+
+/*
+ * Include cache: the tokens of a line of an include file are
+ * recorded when the line is scanned, and replayed when it is read
+ * again. Both go on only while each token starts where the previous
+ * one ended. Raw reading of the line (macro arguments, going back
+ * to peeked tokens) stops them, and the tokens recorded up to that
+ * point are kept.
+ */
+static struct line_cache *play_line; /* line being replayed */
+static int play_pos;                 /* next token to replay */
+static struct line_cache *rec_line;  /* line being recorded */
+static struct cached_token *rec_toks;
+static int rec_count, rec_size;
+static char *lc_ptr;   /* line_buf_ptr at the start of the next token */
+static int scan_error; /* scan_token() found an error */
+
+static void set_token_text(char *cp, int len);
 
 int ifskip_mode; /* TRUE when skipping code inside if..endif */
 
+/*
+ * read_src_char() with an inline fast path for
+ * characters inside the current line
+ */
+#define NEXT_CHAR() \
+  ((line_buf_ptr != NULL && line_buf_ptr < line_end) ? \
+   (void)(tok_char = (unsigned char)*line_buf_ptr++) : read_src_char())
+
+/*
+ * Continue scanning at 'p', which must point inside the current
+ * line or just past its end. Used after scanning a token
+ * directly from the line.
+ */
+#define SCAN_TO(p) (line_buf_ptr = (p), NEXT_CHAR())
+
+/*
+ * Build the keyword index and check the keyword table
+ * against the token definitions
+ */
+void
+init_tokenizer(void)
+{
+  static char seen[NUM_KEYWORDS];
+  struct keyword *kw, **kwp;
+  int i, len, c;
+
+  for(c = 0; c < 26; c++) {
+    for(len = 0; len <= KW_MAXLEN; len++)
+      kw_index[c][len] = NULL;
+  }
+  for(i = 0; i < NUM_KEYWORDS; i++)
+    seen[i] = 0;
+
+  for(i = 0; i < KW_TABLE_SIZE; i++) {
+    kw = &Keyword_Table[i];
+    len = strlen(kw->name);
+    c = kw->name[0] - 'a';
+
+    if(kw->token < FIRST_KW || kw->token >= KW_END_POS
+       || seen[kw->token-FIRST_KW]
+       || c < 0 || c >= 26 || len > KW_MAXLEN)
+      fatal_error("Keyword table out of sync with token definitions");
+    seen[kw->token-FIRST_KW] = 1;
+
+    /* keep the table order inside a slot */
+    for(kwp = &kw_index[c][len]; *kwp != NULL; kwp = &(*kwp)->next)
+      ;
+    kw->next = NULL;
+    *kwp = kw;
+  }
+
+  token_string_size = TOKSIZE;
+  token_string = mem_alloc(token_string_size);
+  token_string[0] = '\0';
+}
+
+/*
+ * Look up a keyword. Returns the keyword token code,
+ * or TOK_IDENTIFIER if the name is not a keyword.
+ */
+static int
+lookup_keyword(char *name, int len)
+{
+  struct keyword *kw;
+  char *cp, *kp;
+  int c;
+
+  if(len > KW_MAXLEN)
+    return TOK_IDENTIFIER;
+
+  /*
+   * keywords consist of lower case letters only, and the other
+   * identifier characters can't be mapped to them by setting bit 5
+   */
+  c = (name[0] | 0x20) - 'a';
+  if(c < 0 || c >= 26)
+    return TOK_IDENTIFIER;
+
+  for(kw = kw_index[c][len]; kw != NULL; kw = kw->next) {
+    for(cp = name, kp = kw->name; *kp != '\0' && (*cp | 0x20) == *kp; cp++, kp++)
+      ;
+    if(*kp == '\0')
+      return kw->token;
+  }
+  return TOK_IDENTIFIER;
+}
+
+/*
+ * Bodies of finished loops. They are freed when the next loop
+ * starts, as the tokenizer may still use the last line.
+ */
+static struct macro_line *dead_loops;
+
+/* number of macro expansions in progress */
+static int macro_depth;
+
+/*
+ * Conditional skip index: where the block skipped by if_else_skip()
+ * starting from a line ends. Skips in macros are only indexed if
+ * no macro arguments were substituted, as the arguments could
+ * change the IF/ELSE/ENDIF structure.
+ */
+static struct inc_file *skip_file; /* file or macro being indexed */
+static struct line_cache *skip_lc;
+static struct macro_line *skip_ml;
+static int skip_linenum;
+static int skip_args; /* macro arguments substituted */
+
+/*
+ * A macro call in tail position reuses the frame of the expansion
+ * it ends. The rest of that expansion (its ENDIF lines) is kept
+ * here, and read when the new expansion ends, as it would be
+ * after returning from a nested frame.
+ */
+struct tail_call {
+  struct tail_call *next;
+  struct symbol *sym;
+  struct macro_line *ml; /* the lines after the call */
+  int linenum;
+  int cond_nest_count; /* of the calling expansion */
+};
+
+/*
+ * Frame for expanding a macro of one line without allocating
+ * memory. Such macros are often used for single instructions.
+ */
+static struct inc_file inline_frame;
+static int inline_busy;
+static struct macro_arg *inline_args; /* argument block of inline_frame */
+static int inline_args_size;
+
+/*
+ * Memory pools. Frames and small argument blocks are reused,
+ * macro definitions and the macro cache stay until the end.
+ */
+#define ARG_BLOCK 128 /* argument blocks up to this size are pooled */
+
+static struct pool frame_pool = { "include/macro frames", sizeof(struct inc_file) };
+static struct pool arg_pool = { "macro arguments", ARG_BLOCK };
+static struct pool macro_pool = { "macro definitions" };
+static struct pool memo_pool = { "macro cache" };
+static struct pool tail_pool = { "macro tail calls", sizeof(struct tail_call) };
+
+static struct macro_arg *
+alloc_args(int size)
+{
+  return (size <= ARG_BLOCK ? pool_alloc(&arg_pool) : mem_alloc(size));
+}
+
+static void
+free_args(struct macro_arg *args, int size)
+{
+  if(args != NULL) {
+    if(size <= ARG_BLOCK)
+      pool_free(&arg_pool, args);
+    else
+      mem_free(args);
+  }
+}
+
 /*
  * include file handling
  */
@@ -104,26 +367,38 @@ begin_include(char *fname)
 {
   struct inc_file *p;
 
-  p = mem_alloc(sizeof(struct inc_file));
+  p = pool_alloc(&frame_pool);
   p->type = INC_FILE;
   p->v.f.fname = mem_alloc(strlen(fname)+1);
   strcpy(p->v.f.fname, fname);
   p->linenum = 0;
   p->cond_nest_count = cond_nest_count;
+  p->v.f.guard = GUARD_START;
+  p->v.f.guard_name = NULL;
 
-  if((p->v.f.fp = fopen(p->v.f.fname, "r")) == NULL) {
+  /* the main file is read only once, only include files are recorded */
+  if((p->v.f.src = open_source(p->v.f.fname, current_file != NULL))
+     == NULL) {
     if(current_file == NULL) {
       fatal_error("Can't open '%s'", p->v.f.fname);
     } else {
       error(0, "Can't open include file '%s'", p->v.f.fname);
       free(p->v.f.fname);
-      free(p);
+      pool_free(&frame_pool, p);
       line_buf_ptr = NULL;
       tok_char = ' ';
       return;
     }
   }
 
+  /* the file may have been included before with another name */
+  if(current_file != NULL && skip_source(p->v.f.src)) {
+    free(p->v.f.fname);
+    pool_free(&frame_pool, p);
+    return;
+  }
+
+  p->v.f.pos = p->v.f.src->buf.data;
   p->next = current_file;
   current_file = p;
   line_buf_ptr = NULL;
@@ -137,7 +412,8 @@ void
 end_include(void)
 {
   struct inc_file *p;
-  struct macro_arg *arg1, *arg2;
+  struct macro_line *ml;
+  struct tail_call *tc;
 
   if(current_file != NULL) {
     if(cond_nest_count != current_file->cond_nest_count) {
@@ -147,48 +423,337 @@ end_include(void)
 
     p = current_file->next;
     if(current_file->type == INC_FILE) {
-      fclose(current_file->v.f.fp);
+      /* the file contents stay in the include cache */
+      if(current_file->v.f.guard == GUARD_CLOSED
+	 && current_file->v.f.src->guard == NULL)
+	current_file->v.f.src->guard = current_file->v.f.guard_name;
+      else if(current_file->v.f.guard_name != NULL)
+	free(current_file->v.f.guard_name);
       free(current_file->v.f.fname);
     } else { /* free macro arguments */
-      arg1 = current_file->v.m.args;
-      while(arg1 != NULL) {
-	arg2 = arg1->next;
-	free(arg1);
-	arg1 = arg2;
+      if(current_file->type == INC_MACRO)
+	macro_depth--;
+      while((tc = current_file->v.m.tails) != NULL) {
+	current_file->v.m.tails = tc->next;
+	pool_free(&tail_pool, tc);
+      }
+      if(current_file == &inline_frame) {
+	inline_busy = 0;
+	current_file = p;
+	return;
+      }
+      free_args(current_file->v.m.args, current_file->v.m.args_size);
+      if(current_file->type == INC_REPT) {
+	for(ml = current_file->v.m.body; ml->next != NULL; ml = ml->next)
+	  ;
+	ml->next = dead_loops;
+	dead_loops = current_file->v.m.body;
       }
     }
-    free(current_file);
+    pool_free(&frame_pool, current_file);
     current_file = p;
   }
 }
 
 /*
- * Expand a macro
+ * Continue the expansion that a tail call in frame 'f' ended,
+ * when the expansion of the called macro has ended.
+ * Returns 0 if there is no such expansion.
+ */
+static int
+resume_tail_call(struct inc_file *f)
+{
+  struct tail_call *tc;
+
+  if(f->type != INC_MACRO || (tc = f->v.m.tails) == NULL)
+    return 0;
+
+  if(cond_nest_count != f->cond_nest_count) {
+    error(0, "conditional assembly not terminated by ENDIF");
+    cond_nest_count = f->cond_nest_count;
+  }
+  if(skip_file == f) /* don't index a skip across expansions */
+    skip_file = NULL;
+
+  f->v.m.tails = tc->next;
+  f->v.m.sym = tc->sym;
+  f->v.m.ml = tc->ml;
+  f->v.m.memo = NULL;
+  f->linenum = tc->linenum;
+  f->cond_nest_count = tc->cond_nest_count;
+  pool_free(&tail_pool, tc);
+  return 1;
+}
+
+/*
+ * End the current macro expansion (EXITM)
+ */
+void
+exit_macro(void)
+{
+  cond_nest_count = current_file->cond_nest_count;
+  if(resume_tail_call(current_file))
+    return;
+  if(current_file->v.m.depth > 1) {
+    /*
+     * The calling expansion ended with the call. Like a nested
+     * frame, it stays current until the next line is read.
+     */
+    current_file->v.m.ml = NULL;
+    current_file->v.m.depth--;
+  } else {
+    end_include();
+  }
+}
+
+/*
+ * Read a word from a macro line. Returns its keyword code,
+ * TOK_IDENTIFIER if it is not a keyword, or 0 if there is no word.
+ */
+static int
+line_word(char **cpp)
+{
+  char *cp, *ep;
+
+  for(cp = *cpp; IS_SPACE(*cp); cp++)
+    ;
+  *cpp = cp;
+  if(!IS_IDSTART(*cp))
+    return 0;
+  for(ep = cp; IS_IDCHAR(*ep); ep++)
+    ;
+  *cpp = ep;
+  return lookup_keyword(cp, ep-cp);
+}
+
+/*
+ * Check if a macro call on line 'ml' is a tail call: the lines after
+ * it only end conditional blocks, with ENDIF or with an ELSE part that
+ * is skipped. Returns the number of conditionals ended, or -1.
+ */
+static int
+macro_tail(struct macro_line *ml)
+{
+  struct macro_line *p;
+  char *cp;
+  int t, ended, skip;
+
+  if(ml->tail != -2)
+    return ml->tail;
+
+  ended = skip = 0;
+  for(p = ml->next; p != NULL; p = p->next) {
+    if(p->nrefs != 0) /* arguments could change the structure */
+      break;
+
+    cp = p->text;
+    t = line_word(&cp);
+    if(skip > 0) { /* as if_else_skip() sees it */
+      if(t == TOK_IDENTIFIER) {
+	while(IS_SPACE(*cp))
+	  cp++;
+	if(*cp == ':')
+	  cp++;
+	t = line_word(&cp);
+      }
+      if(t == KW_IF)
+	skip++;
+      else if(t == KW_ENDIF && --skip == 0)
+	ended++;
+      else if((t == KW_ELSE && skip == 1) || t == KW_END)
+	break;
+    } else {
+      if(t != 0 && t != KW_ENDIF && t != KW_ELSE)
+	break;
+      while(IS_SPACE(*cp))
+	cp++;
+      if(*cp != ';' && *cp != '\n' && *cp != '\0')
+	break;
+      if(t == KW_ENDIF)
+	ended++;
+      else if(t == KW_ELSE)
+	skip = 1;
+    }
+  }
+  ml->tail = (p == NULL && skip == 0 ? ended : -1);
+  return ml->tail;
+}
+
+/*
+ * Macro expansion cache. The lines of a macro expanded with the
+ * same arguments are the same text, so a line is expanded and
+ * scanned once, and its tokens are replayed in later expansions.
+ * Lines using \@ are different in each expansion and are not cached.
+ * Conditionals and symbols are still handled each time the line is
+ * assembled, so SET symbols don't affect the cache.
+ *
+ * An expansion is remembered when a macro is called, and its lines
+ * are stored when it is called again with the same arguments.
+ */
+#define MEMO_HASH_SIZE 256
+#define MEMO_MAX 4096 /* maximum number of remembered expansions */
+
+struct macro_memo {
+  struct macro_memo *next;
+  struct symbol *sym;
+  unsigned int hash;
+  int nargs, keylen;
+  int nlines;
+  struct macro_line **lines; /* expanded lines by line number */
+  char key[1]; /* the arguments, each followed by '\0' */
+};
+
+static struct macro_memo *memo_table[MEMO_HASH_SIZE];
+static int memo_count;
+static int memo_hits, memo_misses, memo_lines;
+
+/*
+ * Find the cached expansion of a macro with the given arguments,
+ * or remember a new one. Returns NULL if the cache is full.
+ */
+static struct macro_memo *
+find_memo(struct symbol *sym, struct macro_arg *args, int nargs,
+	  char *argtext)
+{
+  static char *key;
+  static int key_size;
+  struct macro_memo *mp;
+  unsigned int h;
+  int i, n;
+
+  for(i = 0, n = 0; i < nargs; i++)
+    n += args[i].len+1;
+  if(n > key_size) {
+    key_size = n+64;
+    key = mem_realloc(key, key_size);
+  }
+
+  h = SYM_HASH_INIT;
+  for(i = 0, n = 0; i < nargs; i++) {
+    memcpy(key+n, argtext+args[i].off, args[i].len);
+    n += args[i].len;
+    key[n++] = '\0';
+  }
+  for(i = 0; i < n; i++)
+    h = SYM_HASH_STEP(h, key[i]);
+
+  for(mp = memo_table[h % MEMO_HASH_SIZE]; mp != NULL; mp = mp->next) {
+    if(mp->sym == sym && mp->hash == h && mp->nargs == nargs
+       && mp->keylen == n && memcmp(mp->key, key, n) == 0) {
+      memo_hits++;
+      if(mp->lines == NULL) { /* second call, store the lines */
+	mp->lines = arena_alloc(&memo_pool,
+				mp->nlines*sizeof(struct macro_line *));
+	for(i = 0; i < mp->nlines; i++)
+	  mp->lines[i] = NULL;
+      }
+      return mp;
+    }
+  }
+
+  memo_misses++;
+  if(memo_count >= MEMO_MAX)
+    return NULL;
+  memo_count++;
+
+  mp = arena_alloc(&memo_pool, sizeof(struct macro_memo)+n);
+  mp->sym = sym;
+  mp->hash = h;
+  mp->nargs = nargs;
+  mp->keylen = n;
+  memcpy(mp->key, key, n);
+  mp->nlines = sym->v.def->nlines;
+  mp->lines = NULL;
+  mp->next = memo_table[h % MEMO_HASH_SIZE];
+  memo_table[h % MEMO_HASH_SIZE] = mp;
+  return mp;
+}
+
+/*
+ * Print macro expansion cache statistics
+ */
+void
+print_macro_stats(FILE *fp)
+{
+  fprintf(fp, "Macro cache: %d hit%s, %d miss%s, %d line%s cached\n",
+	  memo_hits, memo_hits == 1 ? "" : "s",
+	  memo_misses, memo_misses == 1 ? "" : "es",
+	  memo_lines, memo_lines == 1 ? "" : "s");
+}
+
+/*
+ * Expand a macro. The arguments are stored in one block owned
+ * by the expansion: an array of (offset, length) pairs followed
+ * by a copy of the macro call line that they point to.
  */
 void
 expand_macro(struct symbol *sym)
 {
+  static struct macro_arg *args;
+  static int args_size;
   struct inc_file *minc;
-  struct macro_arg *arg;
+  struct tail_call *tc;
+  struct macro_arg *oldargs;
+  int oldsize;
   char *cp;
-  int narg;
+  int narg, len, n;
   int parcnt, d_char;
 
+  unpeek_tokens(); /* the arguments are read as raw text */
   write_listing_line(0); /* list the macro call line */
 
-  minc = mem_alloc(sizeof(struct inc_file));
-  minc->type = INC_MACRO;
+  /*
+   * A macro call that ends a macro expansion reuses its frame,
+   * so recursion in tail position doesn't allocate a new one
+   * and doesn't count towards the nesting depth. The number of
+   * such calls in one frame has its own, larger limit.
+   */
+  minc = current_file;
+  if(minc->type == INC_MACRO && minc != &inline_frame
+     && macro_tail(minc->v.m.cur) >= 0
+     && cond_nest_count - minc->cond_nest_count == minc->v.m.cur->tail) {
+    if(minc->v.m.depth >= TAIL_CALL_MAX)
+      fatal_error("Too many macro tail calls (max. %ld)", TAIL_CALL_MAX);
+    oldargs = minc->v.m.args;
+    oldsize = minc->v.m.args_size;
+    if(minc->v.m.cur->next != NULL) {
+      /* the rest of the expansion is read after the call */
+      tc = pool_alloc(&tail_pool);
+      tc->sym = minc->v.m.sym;
+      tc->ml = minc->v.m.cur->next;
+      tc->linenum = minc->linenum;
+      tc->cond_nest_count = minc->cond_nest_count;
+      tc->next = minc->v.m.tails;
+      minc->v.m.tails = tc;
+    }
+    minc->v.m.depth++;
+  } else {
+    if(macro_depth >= macro_depth_limit)
+      fatal_error("Macro expansion nested too deeply (max. %d levels)",
+		  macro_depth_limit);
+    macro_depth++;
+    oldargs = NULL;
+    oldsize = 0;
+    if(!inline_busy && sym->v.def->nlines == 1) {
+      minc = &inline_frame;
+      inline_busy = 1;
+    } else {
+      minc = pool_alloc(&frame_pool);
+    }
+    minc->type = INC_MACRO;
+    minc->v.m.tails = NULL;
+    minc->v.m.depth = 1;
+    minc->next = current_file;
+  }
+  minc->cond_nest_count = cond_nest_count;
   minc->v.m.sym = sym;
-  minc->v.m.ml = sym->v.text;
+  minc->v.m.ml = sym->v.def->lines;
   minc->linenum = 0;
-  minc->cond_nest_count = cond_nest_count;
-  minc->v.m.args = NULL;
-  minc->v.m.uniq_id = unique_id_count++;
-  arg = NULL;
+  minc->v.m.uniq = unique_id_count++;
 
-  for(narg = 1;;narg++) {
-    while(tok_char != '\n' && isspace(tok_char)) /* skip whitespace */
-      read_src_char();
+  for(narg = 0;;) {
+    while(IS_SPACE(tok_char)) /* skip whitespace */
+      NEXT_CHAR();
 
     if(tok_char == '\n' || tok_char == '\0' ||
        tok_char == ';' || tok_char == EOF)
@@ -207,7 +772,7 @@ expand_macro(struct symbol *sym)
 
     parcnt = 0; /* parenthesis nesting count */
 
-    while(!isspace(tok_char) &&
+    while(!IS_SPACE(tok_char) &&
 	  tok_char != '\n' && tok_char != '\0' &&
 	  tok_char != ';' && tok_char != EOF) {
       if(parcnt == 0 && tok_char == ',')
@@ -221,160 +786,891 @@ expand_macro(struct symbol *sym)
 	/* quoted string or character constant */
 	d_char = tok_char;
 
-	do {
-	  read_src_char();
-	}
-	while(tok_char != d_char && tok_char != '\n' &&
-	      tok_char != '\0' && tok_char != EOF);
+	do {
+	  NEXT_CHAR();
+	}
+	while(tok_char != d_char && tok_char != '\n' &&
+	      tok_char != '\0' && tok_char != EOF);
+
+	if(tok_char != d_char)
+	  break;
+      }
+
+      NEXT_CHAR();
+    }
+
+    if(narg == args_size) {
+      args_size = (args_size == 0 ? 16 : 2*args_size);
+      args = mem_realloc(args, args_size*sizeof(struct macro_arg));
+    }
+    args[narg].off = cp-line_start;
+    args[narg++].len = line_buf_ptr-cp-1;
+
+    /* skip whitespace */
+    while(IS_SPACE(tok_char))
+      NEXT_CHAR();
+    if(tok_char != ',')
+      break;
+
+    NEXT_CHAR();
+  }
+
+  if(tok_char != ';' && tok_char != '\n' &&
+     tok_char != '\0' && tok_char != EOF)
+    error(0, "Extraneous characters after a valid source line");
+
+  minc->v.m.nargs = narg;
+  if(minc == &inline_frame && sym->v.def->lines->nrefs == 0) {
+    /* the arguments are not used */
+    minc->v.m.args = NULL;
+    minc->v.m.argtext = NULL;
+    minc->v.m.memo = NULL;
+  } else {
+    len = (narg > 0 ? line_end-line_start : 0);
+    n = narg*sizeof(struct macro_arg) + len + 1;
+    if(minc != &inline_frame) {
+      minc->v.m.args = alloc_args(n);
+      minc->v.m.args_size = n;
+    } else {
+      if(n > inline_args_size) {
+	inline_args_size = n+64;
+	inline_args = mem_realloc(inline_args, inline_args_size);
+      }
+      minc->v.m.args = inline_args;
+    }
+    memcpy(minc->v.m.args, args, narg*sizeof(struct macro_arg));
+    minc->v.m.argtext = (char *)(minc->v.m.args + narg);
+    memcpy(minc->v.m.argtext, line_start, len);
+    minc->v.m.memo = find_memo(sym, minc->v.m.args, narg, minc->v.m.argtext);
+  }
+  free_args(oldargs, oldsize);
+
+  current_file = minc;
+
+  line_buf_ptr = NULL;
+  tok_char = ' ';
+  get_token();
+}
+
+/*
+ * Start a REPT or WHILE loop. The body is run from a single
+ * frame, the ENDR line at its end restarts it.
+ */
+void
+begin_loop(struct macro_line *body, int loop, long count)
+{
+  struct inc_file *minc;
+
+  free_macro_lines(dead_loops);
+  dead_loops = NULL;
+
+  minc = pool_alloc(&frame_pool);
+  minc->type = INC_REPT;
+  minc->v.m.sym = NULL;
+  minc->v.m.ml = minc->v.m.body = body;
+  minc->v.m.cur = NULL;
+  minc->v.m.args = NULL;
+  minc->v.m.args_size = 0;
+  minc->v.m.argtext = NULL;
+  minc->v.m.nargs = 0;
+  minc->v.m.memo = NULL;
+  minc->v.m.tails = NULL;
+  minc->v.m.depth = 0;
+  minc->v.m.loop = loop;
+  minc->v.m.count = count;
+  minc->linenum = 0;
+  minc->cond_nest_count = cond_nest_count;
+
+  minc->next = current_file;
+  current_file = minc;
+
+  line_buf_ptr = NULL;
+  tok_char = ' ';
+  get_token();
+}
+
+/*
+ * Macro line expansion buffer. Grows as needed, so expanded
+ * macro lines have no length limit.
+ */
+static char *mline_buf;
+static int mline_size;
+
+/*
+ * Make room for 'len' more characters at offset 'pos'
+ * in the macro line expansion buffer
+ */
+static void
+mline_reserve(int pos, int len)
+{
+  if(pos+len > mline_size) {
+    mline_size = (mline_size == 0 ? 256 : 2*mline_size);
+    if(mline_size < pos+len)
+      mline_size = pos+len;
+    mline_buf = mem_realloc(mline_buf, mline_size);
+  }
+}
+
+/*
+ * Initialize the fields of a new macro line
+ */
+static void
+init_macro_line(struct macro_line *ml)
+{
+  ml->next = NULL;
+  ml->skip_to = NULL;
+  ml->skip_lines = 0;
+  ml->tail = -2; /* not checked yet */
+  ml->refs = NULL;
+  ml->nrefs = 0;
+  ml->lc.toks = NULL;
+  ml->lc.ntoks = 0;
+  ml->lc.skip_to = 0;
+  ml->shown = NULL;
+}
+
+/*
+ * Allocate a macro line with room for 'len' characters of text,
+ * from the arena if it is kept until the end of assembly
+ */
+static struct macro_line *
+alloc_macro_line(int len, int keep)
+{
+  struct macro_line *ml;
+
+  if(keep)
+    ml = arena_alloc(&macro_pool, sizeof(struct macro_line)+len);
+  else
+    ml = mem_alloc(sizeof(struct macro_line)+len);
+  init_macro_line(ml);
+  return ml;
+}
+
+/*
+ * Make a line of a REPT/WHILE body. The text is used as it is,
+ * parameter references in a macro have been substituted already.
+ */
+struct macro_line *
+new_macro_line(char *text, int len)
+{
+  struct macro_line *ml;
+
+  ml = alloc_macro_line(len, 0);
+  memcpy(ml->text, text, len);
+  ml->text[len] = '\0';
+  ml->len = len;
+  return ml;
+}
+
+/*
+ * Free a list of macro lines
+ */
+void
+free_macro_lines(struct macro_line *ml)
+{
+  struct macro_line *next;
+
+  for(; ml != NULL; ml = next) {
+    next = ml->next;
+    if(ml->lc.ntoks > 0)
+      mem_free(ml->lc.toks);
+    if(ml->refs != NULL)
+      mem_free(ml->refs);
+    if(ml->shown != NULL)
+      mem_free(ml->shown);
+    mem_free(ml);
+  }
+}
+
+/*
+ * Get the argument number from '{n}' at cp
+ * returns the number, or 0 if it is not valid
+ */
+static int
+brace_arg(char *cp, char *end)
+{
+  int n;
+
+  n = 0;
+  for(cp++; cp < end && IS_DIGIT(*cp) && n < 10000; cp++)
+    n = 10*n + (*cp - '0');
+  return (cp < end && *cp == '}') ? n : 0;
+}
+
+/*
+ * The lines of the macro being defined are compiled into a staging
+ * buffer, and moved to the arena in one block at ENDM. 'def_lines'
+ * has the offsets of each line and its references in the buffer.
+ */
+struct def_line {
+  int off, refs;
+};
+
+static char *def_buf;
+static int def_size, def_len;
+static struct def_line *def_lines;
+static int def_nlines, def_max;
+static struct macro_def *macro_defs; /* all macros */
+
+/*
+ * Compile a macro line at definition time. The parameter
+ * references (\1..\9, \{n}, \@, \0 and \#) are taken out of
+ * the text, and listed after the line in the order they appear.
+ */
+void
+compile_macro_line(char *text, int len)
+{
+  struct macro_line *ml;
+  struct macro_ref *refs;
+  char *scp, *end;
+  int n, nref, slot, size;
+
+  /* the text ends at a NUL character, as it did in the source */
+  end = memchr(text, '\0', len);
+  if(end == NULL)
+    end = text+len;
+
+  for(nref = 0, scp = text; scp < end; scp++) {
+    if(*scp == '\\')
+      nref++;
+  }
+
+  /* room for the line, followed by its references */
+  n = ARENA_ROUND(sizeof(struct macro_line)+len);
+  size = n + ARENA_ROUND(nref*sizeof(struct macro_ref));
+  if(def_len+size > def_size) {
+    def_size = (def_size == 0 ? 4096 : 2*def_size);
+    if(def_size < def_len+size)
+      def_size = def_len+size;
+    def_buf = mem_realloc(def_buf, def_size);
+  }
+  if(def_nlines == def_max) {
+    def_max = (def_max == 0 ? 64 : 2*def_max);
+    def_lines = mem_realloc(def_lines, def_max*sizeof(struct def_line));
+  }
+  def_lines[def_nlines].off = def_len;
+  def_lines[def_nlines++].refs = def_len+n;
+  ml = (struct macro_line *)(def_buf+def_len);
+  refs = (struct macro_ref *)(def_buf+def_len+n);
+  def_len += size;
+  init_macro_line(ml);
+
+  n = 0;
+  nref = 0;
+  scp = text;
+  while(scp < end) {
+    if(*scp == '\\') {
+      scp++;
+      if(scp < end && *scp >= '1' && *scp <= '9') { /* macro arg */
+	refs[nref].pos = n;
+	refs[nref++].slot = *scp++ - '1';
+      } else if(scp < end && (*scp == '0' || *scp == '@')) {
+	refs[nref].pos = n;
+	refs[nref++].slot = MREF_UNIQ;
+	scp++;
+      } else if(scp < end && *scp == '{' && (slot = brace_arg(scp, end)) > 0) {
+	refs[nref].pos = n; /* \{n}, any argument */
+	refs[nref++].slot = slot-1;
+	scp = memchr(scp, '}', end-scp)+1;
+      } else if(scp < end && *scp == '#') { /* number of arguments */
+	refs[nref].pos = n;
+	refs[nref++].slot = MREF_NARGS;
+	scp++;
+      } else if(scp < end) {
+	/* the character is copied, and then read again */
+	ml->text[n++] = *scp;
+      }
+    } else {
+      ml->text[n++] = *scp++;
+    }
+  }
+  ml->text[n] = '\0';
+  ml->len = n;
+  ml->nrefs = nref;
+}
+
+/*
+ * Move the lines compiled for a macro to the arena, after the
+ * definition header and the table of line offsets. The lines
+ * are also linked in order, as they are usually read that way.
+ */
+struct macro_def *
+end_macro_def(void)
+{
+  struct macro_def *def;
+  struct macro_line *ml;
+  int i, n;
+
+  n = ARENA_ROUND(sizeof(struct macro_def) + def_nlines*sizeof(int));
+  def = arena_alloc(&macro_pool, n+def_len);
+  memcpy((char *)def + n, def_buf, def_len);
+  def->nlines = def_nlines;
+  def->lines = NULL;
+  for(i = def_nlines; i-- > 0;) {
+    def->off[i] = n + def_lines[i].off;
+    ml = MACRO_LINE(def, i);
+    if(ml->nrefs > 0)
+      ml->refs = (struct macro_ref *)((char *)def + n + def_lines[i].refs);
+    ml->next = def->lines;
+    def->lines = ml;
+  }
+  def->next = macro_defs;
+  macro_defs = def;
+  def_len = def_nlines = 0;
+  return def;
+}
+
+/*
+ * Free the memory of the tokenizer and the macros at the end
+ * of assembly. Macro definitions and the macro cache are in
+ * the arena, but the tokens recorded for their lines are not.
+ */
+void
+release_tokenizer(void)
+{
+  struct macro_def *def;
+  struct macro_memo *mp;
+  struct macro_line *ml;
+  int i, j;
+
+  for(def = macro_defs; def != NULL; def = def->next) {
+    for(ml = def->lines; ml != NULL; ml = ml->next) {
+      if(ml->lc.ntoks > 0)
+	mem_free(ml->lc.toks);
+    }
+  }
+  macro_defs = NULL;
+
+  for(i = 0; i < MEMO_HASH_SIZE; i++) {
+    for(mp = memo_table[i]; mp != NULL; mp = mp->next) {
+      if(mp->lines == NULL)
+	continue;
+      for(j = 0; j < mp->nlines; j++) {
+	if((ml = mp->lines[j]) != NULL && ml->lc.ntoks > 0)
+	  mem_free(ml->lc.toks);
+      }
+    }
+    memo_table[i] = NULL;
+  }
+  memo_count = memo_hits = memo_misses = memo_lines = 0;
+
+  free_macro_lines(dead_loops);
+  dead_loops = NULL;
+
+  mem_free(token_string);
+  token_string = NULL;
+  play_line = rec_line = NULL;
+  skip_file = NULL;
+  peek_count = 0;
+  macro_depth = 0;
+  inline_busy = 0;
+}
+
+/*
+ * Expand the next line of the current macro. A line without
+ * parameter references is used as it is, otherwise the text
+ * and the arguments are copied to the macro line buffer.
+ * Returns the token cache of the line, or NULL.
+ */
+static struct line_cache *
+expand_macro_line(void)
+{
+  struct macro_line *ml, *cached, **slot;
+  struct macro_ref *ref;
+  struct line_cache *lc;
+  char *cp, num[12];
+  int i, n, pos, len, uniq;
+
+  ml = current_file->v.m.ml;
+  slot = NULL;
+  if(current_file->v.m.memo != NULL && current_file->v.m.memo->lines != NULL)
+    slot = &current_file->v.m.memo->lines[current_file->linenum];
+
+  if(ml->nrefs == 0) {
+    line_start = ml->text;
+    line_end = ml->text+ml->len;
+    lc = &ml->lc;
+  } else if(slot != NULL && (cached = *slot) != NULL) {
+    skip_args = 1;
+    line_start = cached->text;
+    line_end = cached->text+cached->len;
+    lc = &cached->lc;
+  } else {
+    uniq = 0;
+    n = 0;
+    pos = 0;
+    for(i = 0; i < ml->nrefs; i++) {
+      ref = &ml->refs[i];
+      if(ref->pos > pos) {
+	mline_reserve(n, ref->pos-pos);
+	memcpy(mline_buf+n, ml->text+pos, ref->pos-pos);
+	n += ref->pos-pos;
+	pos = ref->pos;
+      }
+
+      if(ref->slot >= 0) {
+	skip_args = 1;
+	if(ref->slot >= current_file->v.m.nargs)
+	  continue;
+	cp = current_file->v.m.argtext + current_file->v.m.args[ref->slot].off;
+	len = current_file->v.m.args[ref->slot].len;
+      } else {
+	if(ref->slot == MREF_UNIQ) {
+	  uniq = 1;
+	  sprintf(num, "%03d", current_file->v.m.uniq);
+	} else {
+	  sprintf(num, "%d", current_file->v.m.nargs);
+	}
+	cp = num;
+	len = strlen(cp);
+      }
+      mline_reserve(n, len);
+      memcpy(mline_buf+n, cp, len);
+      n += len;
+    }
+    mline_reserve(n, ml->len-pos);
+    memcpy(mline_buf+n, ml->text+pos, ml->len-pos);
+    n += ml->len-pos;
+
+    if(slot != NULL && !uniq) {
+      *slot = cached = alloc_macro_line(n, 1);
+      memcpy(cached->text, mline_buf, n);
+      cached->text[n] = '\0';
+      cached->len = n;
+      memo_lines++;
+      line_start = cached->text;
+      line_end = cached->text+n;
+      lc = &cached->lc;
+    } else {
+      line_start = mline_buf;
+      line_end = mline_buf+n;
+      lc = NULL;
+    }
+  }
+  line_shown = ml->shown;
+  current_file->v.m.cur = ml;
+  current_file->v.m.ml = ml->next;
+  return lc;
+}
+
+/*
+ * Keep the tokens recorded for the current line
+ */
+static void
+end_recording(void)
+{
+  struct cached_token *ct;
+
+  if(rec_line != NULL) {
+    if(rec_count > rec_line->ntoks) {
+      ct = mem_alloc(rec_count*sizeof(struct cached_token));
+      memcpy(ct, rec_toks, rec_count*sizeof(struct cached_token));
+      if(rec_line->ntoks > 0)
+	mem_free(rec_line->toks);
+      rec_line->toks = ct;
+      rec_line->ntoks = rec_count;
+    }
+    rec_line = NULL;
+  }
+}
+
+/*
+ * Record the token just scanned. Lines with errors are not
+ * cached, as the errors must be reported again.
+ */
+static void
+record_token(void)
+{
+  struct cached_token *ct;
+
+  if(scan_error || token_type == TOK_EOF ||
+     (cur_token.text == token_string && cur_token.len >= (int)sizeof(ct->str))) {
+    if(scan_error) {
+      if(rec_line->ntoks > 0)
+	mem_free(rec_line->toks);
+      rec_line->toks = NULL;
+      rec_line->ntoks = -1;
+    }
+    rec_line = NULL;
+    return;
+  }
+
+  if(rec_count == rec_size) {
+    rec_size = (rec_size == 0 ? 32 : 2*rec_size);
+    rec_toks = mem_realloc(rec_toks, rec_size*sizeof(struct cached_token));
+  }
+  ct = &rec_toks[rec_count++];
+
+  ct->type = cur_token.type;
+  ct->len = cur_token.len;
+  ct->line_off = cur_token.line_off;
+  ct->atom = cur_token.atom;
+  ct->int_val = cur_token.int_val;
+  if(cur_token.text == token_string) {
+    ct->text_off = -1;
+    strcpy(ct->str, token_string);
+  } else {
+    ct->text_off = cur_token.text-line_start;
+  }
+  ct->start_off = (tok_start_ptr != NULL ? tok_start_ptr-line_start : -1);
+  ct->first = tok_start_char;
+  ct->end_off = (line_buf_ptr != NULL ? line_buf_ptr-line_start : -1);
+  ct->next = tok_char;
+
+  lc_ptr = line_buf_ptr;
+  if(token_type == TOK_NEWLINE)
+    end_recording();
+}
+
+/*
+ * Make a recorded token the current token, and set the
+ * tokenizer state to what it was after scanning the token
+ */
+static void
+replay_token(struct cached_token *ct)
+{
+  cur_token.type = ct->type;
+  cur_token.line_off = ct->line_off;
+  cur_token.atom = ct->atom;
+  cur_token.int_val = ct->int_val;
+  if(ct->text_off >= 0) {
+    set_token_text(line_start+ct->text_off, ct->len);
+  } else {
+    strcpy(token_string, ct->str);
+    cur_token.text = token_string;
+    cur_token.len = ct->len;
+  }
+
+  tok_start_ptr = (ct->start_off >= 0 ? line_start+ct->start_off : NULL);
+  tok_start_char = (unsigned char)ct->first;
+  line_buf_ptr = (ct->end_off >= 0 ? line_start+ct->end_off : NULL);
+  tok_char = (unsigned char)ct->next;
+  lc_ptr = line_buf_ptr;
+}
+
+/*
+ * Move to the next source line (from a file or a macro).
+ * Handles the end of include files and macros.
+ * Returns FAIL at the end of the main source file.
+ */
+static int
+next_line(void)
+{
+  struct inc_file *f;
+  struct line_cache *lc;
+  char *p, *end;
+
+  end_recording();
+  play_line = NULL;
+  line_shown = NULL;
+  lc = NULL;
+
+  for(;;) {
+    if((f = current_file) == NULL)
+      return FAIL;
+
+    if(f->type != INC_FILE) {
+      if(f->v.m.ml != NULL || resume_tail_call(f)) {
+	lc = expand_macro_line();
+	break;
+      }
+    } else {
+      p = f->v.f.pos;
+      end = f->v.f.src->buf.data + f->v.f.src->buf.size;
+      if(p < end) {
+	if(f->v.f.src->record && f->linenum < f->v.f.src->nlines)
+	  lc = &f->v.f.src->lines[f->linenum];
+
+	/* memchr() is usually the fastest way to find the line end */
+	if((end = memchr(p, '\n', end-p)) != NULL) {
+	  line_start = p;
+	  line_end = f->v.f.pos = end+1;
+	} else {
+	  /*
+	   * Copy a last line without a newline, so that every
+	   * line ends with one and no token runs into the
+	   * next line
+	   */
+	  end = f->v.f.src->buf.data + f->v.f.src->buf.size;
+	  mline_reserve(0, end-p+1);
+	  memcpy(mline_buf, p, end-p);
+	  mline_buf[end-p] = '\n';
+	  line_start = mline_buf;
+	  line_end = mline_buf + (end-p+1);
+	  f->v.f.pos = end;
+	}
+	break;
+      }
+      if(f->next == NULL)
+	return FAIL;
+    }
+    end_include();
+  }
+
+  current_file->linenum++;
+  line_buf_ptr = line_start;
+
+  if(lc != NULL && lc->ntoks >= 0) {
+    lc_ptr = line_start+1; /* after read_src_char() */
+    if(lc->ntoks > 0) {
+      play_line = lc;
+      play_pos = 0;
+    } else {
+      rec_line = lc;
+      rec_count = 0;
+    }
+  }
+  return OK;
+}
+
+/*
+ * Read a character from source file.
+ * Handles includes and macros.
+ */
+void
+read_src_char(void)
+{
+  while(line_buf_ptr == NULL || line_buf_ptr >= line_end) {
+    if(next_line() != OK) {
+      tok_char = EOF;
+      return;
+    }
+  }
+  tok_char = ((unsigned char)(*line_buf_ptr++));
+}
+
+/*
+ * Skip whitespace, but not newlines. Runs of blanks are
+ * skipped with a pointer scan over the current line.
+ */
+static void
+skip_space(void)
+{
+  char *p;
+
+  while(IS_SPACE(tok_char)) {
+    p = line_buf_ptr;
+    if(p != NULL) {
+      while(p < line_end && IS_SPACE(*p))
+	p++;
+      line_buf_ptr = p;
+    }
+    NEXT_CHAR();
+  }
+}
+
+/*
+ * Numbers are scanned straight from the source line. The value
+ * is accumulated in every radix that a suffix could still select,
+ * and the last digit is held back until the character after it is
+ * known, so that 'B' and 'D' can be either digits or suffixes.
+ */
+#define NUM_BIN 0x01
+#define NUM_OCT 0x02
+#define NUM_DEC 0x04
+#define NUM_HEX 0x08
+
+/* largest value that fits in EXPR_NBITS bits */
+#define NUM_MAX ((((unsigned long)1 << (EXPR_NBITS-1)) << 1) - 1)
+
+struct numscan {
+  unsigned long bin, oct, dec, hex;
+  int bad; /* NUM_* bits for radixes with invalid digits */
+  int ovf; /* NUM_* bits for radixes that have overflowed */
+};
+
+static void
+num_digit(struct numscan *ns, int c)
+{
+  int d;
+
+  d = IS_DIGIT(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+
+  /* a radix keeps the value it had before its first invalid digit */
+  if(d > 1)
+    ns->bad |= NUM_BIN;
+  if(d > 7)
+    ns->bad |= NUM_OCT;
+  if(d > 9)
+    ns->bad |= NUM_DEC;
+
+  if(!(ns->bad & NUM_BIN)) {
+    if(ns->bin >> (EXPR_NBITS-1))
+      ns->ovf |= NUM_BIN;
+    ns->bin = (ns->bin << 1) + d;
+  }
+
+  if(!(ns->bad & NUM_OCT)) {
+    if(ns->oct >> (EXPR_NBITS-3))
+      ns->ovf |= NUM_OCT;
+    ns->oct = (ns->oct << 3) + d;
+  }
 
-	if(tok_char != d_char)
-	  break;
-      }
+  if(!(ns->bad & NUM_DEC)) {
+    if(ns->dec > NUM_MAX/10 || (ns->dec == NUM_MAX/10 && d > NUM_MAX%10))
+      ns->ovf |= NUM_DEC;
+    ns->dec = ns->dec*10 + d;
+  }
 
-      read_src_char();
-    }
+  if(ns->hex >> (EXPR_NBITS-4))
+    ns->ovf |= NUM_HEX;
+  ns->hex = (ns->hex << 4) + d;
+}
 
-    if(narg >= 10)
-      warning("Too many macro arguments (max. 9)");
+/*
+ * Set token_int_val from the accumulated value in one radix
+ */
+static void
+num_value(struct numscan *ns, int radix)
+{
+  switch(radix) {
+    case NUM_BIN: token_int_val = (long)ns->bin; break;
+    case NUM_OCT: token_int_val = (long)ns->oct; break;
+    case NUM_DEC: token_int_val = (long)ns->dec; break;
+    default:      token_int_val = (long)ns->hex; break;
+  }
 
-    if(arg == NULL) {
-      arg = mem_alloc(sizeof(struct macro_arg)
-		      +(line_buf_ptr-cp-1));
-      minc->v.m.args = arg;
-    } else {
-      arg->next = mem_alloc(sizeof(struct macro_arg)
-			    +(line_buf_ptr-cp-1));
-      arg = arg->next;
-    }
-    strncpy(arg->text, cp, line_buf_ptr-cp-1);
-    arg->text[line_buf_ptr-cp-1] = '\0';
-    arg->next = NULL;
+  if((ns->bad | ns->ovf) & radix)
+    scan_error = 1;
+  if(!ifskip_mode) {
+    if(ns->bad & radix)
+      error(0, "Invalid digit in a number");
+    else if(ns->ovf & radix)
+      error(0, "Number does not fit in %d bits", EXPR_NBITS);
+  }
+}
 
-    /* skip whitespace */
-    while(tok_char != '\n' && isspace(tok_char))
-      read_src_char();
-    if(tok_char != ',')
-      break;
+/*
+ * Scan the digits of a 0x1F or $1F hex number, starting at 'p'
+ */
+static void
+scan_hex(char *p)
+{
+  struct numscan ns;
 
-    read_src_char();
+  memset(&ns, 0, sizeof(ns));
+  for(; p < line_end && IS_XDIGIT(*p); p++)
+    num_digit(&ns, (unsigned char)*p);
+  SCAN_TO(p);
+  num_value(&ns, NUM_HEX);
+}
+
+/*
+ * Scan a number that starts with a digit:
+ * 0x1F, 0b101, 1Fh, 17o, 101b, 99d or 99
+ */
+static void
+scan_number(void)
+{
+  struct numscan ns;
+  char *cp, *p;
+  int c, radix;
+
+  memset(&ns, 0, sizeof(ns));
+  cp = line_buf_ptr-1; /* first digit */
+  p = cp+1;
+
+  if(cp[0] == '0' && p < line_end && (*p | 0x20) == 'x') { /* hex number */
+    scan_hex(p+1);
+    return;
   }
 
-  if(tok_char != ';' && tok_char != '\n' &&
-     tok_char != '\0' && tok_char != EOF)
-    error(0, "Extraneous characters after a valid source line");
+  /* all digits but the last one */
+  c = (unsigned char)*cp;
+  while(p < line_end && IS_XDIGIT(*p)) {
+    num_digit(&ns, c);
+    /* the 'b' of a 0b prefix is not a binary digit */
+    if(p == cp+2 && cp[0] == '0' && (cp[1] | 0x20) == 'b') {
+      ns.bin = 0;
+      ns.bad &= ~NUM_BIN;
+      ns.ovf &= ~NUM_BIN;
+    }
+    c = (unsigned char)*p++;
+  }
 
-  minc->next = current_file;
-  current_file = minc;
+  if(p < line_end && (*p | 0x20) == 'h') {
+    num_digit(&ns, c);
+    radix = NUM_HEX;
+    p++;
+  } else if(p < line_end && (*p | 0x20) == 'o') {
+    num_digit(&ns, c);
+    radix = NUM_OCT;
+    p++;
+  } else if(cp[0] == '0' && p-cp >= 2 && (cp[1] | 0x20) == 'b') {
+    if(p-cp > 2) /* not just "0b" */
+      num_digit(&ns, c);
+    radix = NUM_BIN;
+  } else if((c | 0x20) == 'b') {
+    radix = NUM_BIN;
+  } else if((c | 0x20) == 'd') {
+    radix = NUM_DEC;
+  } else {
+    num_digit(&ns, c);
+    radix = NUM_DEC;
+  }
 
-  line_buf_ptr = NULL;
-  tok_char = ' ';
-  get_token();
+  SCAN_TO(p);
+  num_value(&ns, radix);
 }
 
 /*
- * Read a character from source file.
- * Handles includes and macros.
+ * Scan the digits and the closing quote of B'1010', D'99',
+ * H'1F' or O'17'. 'radix' is NUM_BIN etc.
+ * returns FAIL if the closing quote is missing
  */
-void
-read_src_char(void)
+static int
+scan_quoted_number(int radix)
 {
-  char *scp, *pcp, *dcp;
-  int parm;
-  struct macro_arg *arg;
-  static char tmpbuf[12];
+  struct numscan ns;
+  char *p;
 
-  if(line_buf_ptr == NULL || *line_buf_ptr == '\0') {
-    if(current_file == NULL) {
-      tok_char = EOF;
-      return;
-    }
+  memset(&ns, 0, sizeof(ns));
+  for(p = line_buf_ptr; p < line_end && IS_XDIGIT(*p); p++)
+    num_digit(&ns, (unsigned char)*p);
 
-getc1:
-    if(current_file->type == INC_MACRO)	{
-      if(current_file->v.m.ml == NULL) {
-	end_include();
-	goto getc1;
-      }
+  if(p >= line_end || *p != '\'') {
+    SCAN_TO(p);
+    return FAIL;
+  }
 
-      scp = current_file->v.m.ml->text;
-      dcp = line_buffer;
-      while(*scp != '\0' && dcp < &line_buffer[sizeof(line_buffer)]) {
-	if(*scp == '\\') {
-	  scp++;
-	  if(*scp >= '1' && *scp <= '9') { /* macro arg */
-	    parm = *scp - '1'; /* macro arg #, starting from 0 */
-	    for(arg = current_file->v.m.args;
-		arg != NULL && parm > 0; arg = arg->next, parm--);
-	    if(arg != NULL) {
-	      for(pcp = arg->text; *pcp != '\0' &&
-		  dcp < &line_buffer[sizeof(line_buffer)];)
-		*dcp++ = *pcp++;
-	    }
-	    scp++;
-	  } else if(*scp == '0' || *scp == '@') {
-	    sprintf(tmpbuf, "%03d", current_file->v.m.uniq_id);
-
-	    for(pcp = tmpbuf; *pcp != '\0' &&
-		dcp < &line_buffer[sizeof(line_buffer)];)
-	      *dcp++ = *pcp++;
-
-	    scp++;
-	  } else if(*scp == '#') { /* number of arguments */
-	    for(parm = 0, arg = current_file->v.m.args;
-		arg != NULL; arg = arg->next, parm++);
-
-	    sprintf(tmpbuf, "%d", parm);
-
-	    for(pcp = tmpbuf; *pcp != '\0' &&
-		dcp < &line_buffer[sizeof(line_buffer)];)
-	      *dcp++ = *pcp++;
-
-	    scp++;
-	  } else
-	    *dcp++ = *scp;
-	} else
-	  *dcp++ = *scp++;
-      }
-      if(dcp == &line_buffer[sizeof(line_buffer)]) {
-	error(0, "Line buffer overflow");
-	dcp--;
-      }
+  SCAN_TO(p+1);
+  num_value(&ns, radix);
+  return OK;
+}
 
-      *dcp = '\0'; /* NUL-terminate the line */
-      current_file->v.m.ml = current_file->v.m.ml->next;
-    } else {
-      if(fgets(line_buffer, sizeof(line_buffer)-1,
-	       current_file->v.f.fp) == NULL) {
-	if(current_file->next != NULL) {
-	  end_include();
-	  goto getc1;
-	}
-	tok_char = EOF;
-	return;
-      }
-    }
-    current_file->linenum++;
-    line_buf_ptr = line_buffer;
+/*
+ * Make the current token a view of 'len' characters at 'cp'
+ * in the source line, and copy them to token_string
+ */
+static void
+set_token_text(char *cp, int len)
+{
+  if(len >= token_string_size) {
+    token_string_size = len+TOKSIZE;
+    token_string = mem_realloc(token_string, token_string_size);
   }
-  tok_char = ((unsigned char)(*line_buf_ptr++));
+  memcpy(token_string, cp, len);
+  token_string[len] = '\0';
+  cur_token.text = cp;
+  cur_token.len = len;
 }
 
 /*
  * Lexical analyzer
- * Returns the next token from the source file
+ * Scans the next token from the source file
  */
-void
-get_token(void)
+static void
+scan_token(void)
 {
-  int tp, base;
-  char *cp;
+  unsigned int h;
+  int base;
+  char *cp, *ep;
 
   for(;;) {
     /*
      * skip spaces
      */
-    while(tok_char != '\n' && isspace(tok_char))
-      read_src_char();
+    skip_space();
 
     if(tok_char == EOF)	{
       token_type = TOK_EOF;
@@ -385,23 +1681,26 @@ get_token(void)
     if(tok_char != ';')
       break;
 
-    /* comment */
+    /* comment, the rest of the line is not scanned at all */
     line_buf_ptr = NULL;
     tok_char = '\n';
 
   } /* for(;;) */
 
+  tok_start_ptr = line_buf_ptr;
+  tok_start_char = tok_char;
+
 /*
  * character constant (integer)
  * (does not currently handle the quote character)
  */
   if(tok_char == '\'') {
-    read_src_char();
+    NEXT_CHAR();
     token_string[0] = tok_char;
-    read_src_char();
+    NEXT_CHAR();
     if(tok_char != '\'')
       goto invalid_token;
-    read_src_char();
+    NEXT_CHAR();
     token_string[1] = '\0';
     token_int_val = (long)((unsigned char)token_string[0]);
     token_type = TOK_INTCONST;
@@ -409,16 +1708,19 @@ get_token(void)
   }
 
   if(tok_char == '"') { /* string constant (include filename) */
-    read_src_char();
-    tp = 0;
-    while(tp < TOKSIZE-1 && tok_char != '"' && tok_char != EOF)	{
-      token_string[tp++] = tok_char;
-      read_src_char();
-    }
-    if(tok_char != '\"' && !ifskip_mode)
-      error(0, "String not terminated");
-    token_string[tp] = '\0';
-    read_src_char();
+    cp = line_buf_ptr;
+    ep = cp;
+    while(ep < line_end && *ep != '"' && *ep != '\n')
+      ep++;
+    set_token_text(cp, ep-cp);
+    if(ep >= line_end || *ep != '"') {
+      scan_error = 1;
+      if(!ifskip_mode)
+	error(0, "String not terminated");
+    }
+    if(ep < line_end && *ep == '"')
+      ep++;
+    SCAN_TO(ep);
     token_type = TOK_STRCONST;
     return;
   }
@@ -426,183 +1728,106 @@ get_token(void)
 /*
  * integer number
  */
-  if(isdigit(tok_char)) {
+  if(IS_DIGIT(tok_char)) {
     token_type = TOK_INTCONST;
-    token_string[0] = tok_char;
-    tp = 1;
-    read_src_char();
-    if(token_string[0] == '0') {
-      if(tok_char == 'x' || tok_char == 'X') { /* hex number */
-	token_string[tp++] = tok_char;
-	read_src_char();
-	while(tp < TOKSIZE-1 && isxdigit(tok_char)) {
-	  token_string[tp++] = tok_char;
-	  read_src_char();
-	}
-	token_string[tp] = '\0';
-	token_int_val = strtoul(&token_string[2], NULL, 16);
-	/* should put range check here */
-	return;
-      }
-    }
-
-    while(tp < TOKSIZE-2 && isxdigit(tok_char))	{
-      token_string[tp++] = tok_char;
-      read_src_char();
-    }
-
-    base = 10;
-    switch(tok_char) {
-      case 'H': /* hex */
-      case 'h':
-        base = 16; /* hex */
-	token_string[tp++] = tok_char;
-	read_src_char();
-	break;
-
-      case 'O': /* octal */
-      case 'o':
-	base = 8; /* octal */
-	token_string[tp++] = tok_char;
-	read_src_char();
-	break;
-
-      default:
-	if(token_string[0] == '0' &&
-	   (token_string[1] == 'b' || token_string[1] == 'B')) {
-	  token_string[tp] = '\0';
-	  token_int_val = strtoul(&token_string[2], &cp, 2);
-	  if(cp != &token_string[tp] && !ifskip_mode)
-	    error(0, "Invalid digit in a number");
-	  /* should put range check here */
-	  return;
-	} else if(token_string[tp-1] == 'B' || token_string[tp-1] == 'b') {
-	  base = 2;
-	} else {
-	  if(token_string[tp-1] != 'D' && token_string[tp-1] != 'd')
-	    token_string[tp++] = '\0';
-	}
-	break;
-    }
-
-    token_string[tp] = '\0';
-    token_int_val = strtoul(token_string, &cp, base);
-    if(cp != &token_string[tp-1] && !ifskip_mode)
-      error(0, "Invalid digit in a number");
-    /* should put range check here */
+    token_string[0] = '\0';
+    scan_number();
     return;
   }
 
 /*
  * Handle B'10010100' binary etc.
  */
-  if((tok_char == 'b' || tok_char == 'B' ||
-      tok_char == 'd' || tok_char == 'D' ||
-      tok_char == 'h' || tok_char == 'H' ||
-      tok_char == 'o' || tok_char == 'O') &&
-     line_buf_ptr != NULL && *line_buf_ptr == '\'') {
-    token_string[0] = tok_char;
-    read_src_char();
-    token_string[1] = tok_char;
-    read_src_char();
-    tp = 2;
-    while(tp < TOKSIZE-1 && isxdigit(tok_char))	{
-      token_string[tp++] = tok_char;
-      read_src_char();
-    }
-    if(tok_char != '\'')
-      goto invalid_token;
-    token_string[tp++] = tok_char;
-    read_src_char();
-    token_string[tp] = '\0';
-
-    switch(token_string[0]) {
+  if(line_buf_ptr != NULL && line_buf_ptr < line_end &&
+     *line_buf_ptr == '\'') {
+    switch(tok_char) {
       case 'b':
       case 'B':
-        base = 2;
+        base = NUM_BIN;
 	break;
 
       case 'o':
       case 'O':
-	base = 8;
+	base = NUM_OCT;
 	break;
 
       case 'h':
       case 'H':
-	base = 16;
+	base = NUM_HEX;
 	break;
 
       case 'd':
       case 'D':
+	base = NUM_DEC;
+	break;
+
       default:
-	base = 10;
+	base = 0;
 	break;
     }
 
-    token_int_val = strtoul(&token_string[2], &cp, base);
-    if(cp != &token_string[tp-1] && !ifskip_mode)
-      error(0, "Invalid digit in a number");
-    /* should put range check here */
-    token_type = TOK_INTCONST;
-    return;
+    if(base != 0) {
+      line_buf_ptr++; /* skip the quote */
+      if(scan_quoted_number(base) != OK)
+	goto invalid_token;
+      token_string[0] = '\0';
+      token_type = TOK_INTCONST;
+      return;
+    }
   }
 
 /*
  * keyword or identifier
  */
-  if(tok_char == '_' || tok_char == '.' || isalpha(tok_char)) {
-    line_buf_off = (line_buf_ptr - &line_buffer[1]);
-
-    token_string[0] = tok_char;
-    tp = 1;
-    read_src_char();
-
-    if(token_string[0] == '.' &&
-       tok_char != '_' && !isalnum(tok_char)) {
+  if(IS_IDSTART(tok_char)) {
+    cp = line_buf_ptr-1; /* identifier start */
+    line_buf_off = cp-line_start;
+
+    if(tok_char == '.' &&
+       (line_buf_ptr >= line_end ||
+	*line_buf_ptr == '.' || !IS_IDCHAR(*line_buf_ptr))) {
+      token_string[0] = '.';
       token_string[1] = '\0';
       token_type = TOK_PERIOD;
+      NEXT_CHAR();
       return;
     }
 
-    while(tp < TOKSIZE-1 &&
-	  (tok_char == '_' || tok_char == '.' || isalnum(tok_char))) {
-      token_string[tp++] = tok_char;
-      read_src_char();
-    }
-    token_string[tp] = '\0';
+    h = SYM_HASH_INIT;
+    for(ep = cp; ep < line_end && IS_IDCHAR(*ep); ep++)
+      h = SYM_HASH_STEP(h, *ep);
+    set_token_text(cp, ep-cp);
+    SCAN_TO(ep);
 
-    token_type = FIRST_KW;
-    cp = Keyword_Table;
-    while(*cp) {
-      if(strcasecmp(token_string, cp) == 0)
-	return;
-      while(*cp++)
-	;
-      token_type++;
-    }
-    token_type = TOK_IDENTIFIER;
+    token_type = lookup_keyword(token_string, ep-cp);
+    cur_token.atom = (token_type == TOK_IDENTIFIER ?
+		      intern(cp, ep-cp, h) : NULL);
     return;
   }
 
 /*
  * non-numeric & non-alpha tokens
  */
+  if(!IS_OPSTART(tok_char) && tok_char != '\n' && tok_char != '\0')
+    goto invalid_token;
+
   switch(tok_char) {
     case '\n':
     case '\0':
       token_type = TOK_NEWLINE;
       strcpy(token_string, "\\n");
-      skip_eol();
+      line_buf_ptr = NULL;
+      tok_char = ' ';
       return;
 
     case '<':
       token_string[0] = tok_char;
-      read_src_char();
+      NEXT_CHAR();
       if(tok_char == '<') {
 	token_string[1] = tok_char;
 	token_string[2] = '\0';
 	token_type = TOK_LSHIFT;
-	read_src_char();
+	NEXT_CHAR();
 	return;
       }
 
@@ -610,7 +1835,7 @@ get_token(void)
 	token_string[1] = tok_char;
 	token_string[2] = '\0';
 	token_type = TOK_LESS_EQ;
-	read_src_char();
+	NEXT_CHAR();
 	return;
       }
 
@@ -618,7 +1843,7 @@ get_token(void)
 	token_string[1] = tok_char;
 	token_string[2] = '\0';
 	token_type = TOK_NOT_EQ;
-	read_src_char();
+	NEXT_CHAR();
 	return;
       }
 
@@ -628,12 +1853,12 @@ get_token(void)
 
     case '>':
       token_string[0] = tok_char;
-      read_src_char();
+      NEXT_CHAR();
       if(tok_char == '>') {
 	token_string[1] = tok_char;
 	token_string[2] = '\0';
 	token_type = TOK_RSHIFT;
-	read_src_char();
+	NEXT_CHAR();
 	return;
       }
 
@@ -641,7 +1866,7 @@ get_token(void)
 	token_string[1] = tok_char;
 	token_string[2] = '\0';
 	token_type = TOK_GT_EQ;
-	read_src_char();
+	NEXT_CHAR();
 	return;
       }
 
@@ -651,21 +1876,21 @@ get_token(void)
 
     case '!':
       token_string[0] = tok_char;
-      read_src_char();
+      NEXT_CHAR();
       if(tok_char != '=')
 	goto invalid_token;
       token_string[1] = tok_char;
       token_string[2] = '\0';
-      read_src_char();
+      NEXT_CHAR();
       token_type = TOK_NOT_EQ;
       return;
 
     case '=':
       token_string[0] = tok_char;
-      read_src_char();
+      NEXT_CHAR();
       if(tok_char == '=') {
 	token_string[1] = tok_char;
-	read_src_char();
+	NEXT_CHAR();
 	token_string[2] = '\0';
 	token_type = TOK_EQ;
 	return;
@@ -673,7 +1898,7 @@ get_token(void)
 
       if(tok_char == '<') {
 	token_string[1] = tok_char;
-	read_src_char();
+	NEXT_CHAR();
 	token_string[2] = '\0';
 	token_type = TOK_LESS_EQ;
 	return;
@@ -681,26 +1906,22 @@ get_token(void)
 
       if(tok_char == '>') {
 	token_string[1] = tok_char;
-	read_src_char();
+	NEXT_CHAR();
 	token_string[2] = '\0';
 	token_type = TOK_GT_EQ;
 	return;
       }
 
-      if(tok_char == '_' || tok_char == '.' ||
-	 isalpha(tok_char)) { /* local symbol */
-	line_buf_off = (line_buf_ptr - &line_buffer[2]);
+      if(IS_IDSTART(tok_char)) { /* local symbol */
+	cp = line_buf_ptr-1;
+	line_buf_off = (cp-1)-line_start;
 
-	token_string[0] = tok_char;
-	tp = 1;
-	read_src_char();
-
-	while(tp < TOKSIZE-1 &&
-	      (tok_char == '_' || tok_char == '.' || isalnum(tok_char))) {
-	  token_string[tp++] = tok_char;
-	  read_src_char();
-	}
-	token_string[tp] = '\0';
+	h = SYM_HASH_INIT;
+	for(ep = cp; ep < line_end && IS_IDCHAR(*ep); ep++)
+	  h = SYM_HASH_STEP(h, *ep);
+	set_token_text(cp, ep-cp);
+	cur_token.atom = intern(cp, ep-cp, h);
+	SCAN_TO(ep);
 
 	token_type = TOK_LOCAL_ID;
 	return;
@@ -711,8 +1932,8 @@ get_token(void)
       return;
 
     case '$':
-      read_src_char();
-      if(!isxdigit(tok_char))
+      NEXT_CHAR();
+      if(!IS_XDIGIT(tok_char))
 	{
 	  token_string[0] = '$';
 	  token_string[1] = '\0';
@@ -720,17 +1941,9 @@ get_token(void)
 	  return;
 	}
 
-      tp = 0;
-      do
-	{
-	  token_string[tp++] = tok_char;
-	  read_src_char();
-	} while(tp < TOKSIZE-1 && isxdigit(tok_char));
-
-      token_string[tp] = '\0';
-      token_int_val = strtoul(&token_string[1], NULL, 16);
+      token_string[0] = '\0';
       token_type = TOK_INTCONST;
-      /* should put range check here */
+      scan_hex(line_buf_ptr-1);
       return;
 
     case '\\':
@@ -803,20 +2016,359 @@ get_token(void)
 
   token_string[0] = tok_char;
   token_string[1] = '\0';
-  read_src_char();
+  NEXT_CHAR();
   return;
 
 invalid_token:
+  scan_error = 1;
   if(!ifskip_mode)
     error(0, "Invalid token");
   token_string[0] = '\0';
   token_type = TOK_INVALID;
 }
 
+/*
+ * Scan the next token from the source to cur_token
+ */
+static void
+next_token(void)
+{
+  struct line_cache *lc;
+
+  /* start a new line here, so that its tokens can be replayed */
+  if(line_buf_ptr == NULL && tok_char == ' ')
+    read_src_char();
+
+  if(play_line != NULL) {
+    if(line_buf_ptr == lc_ptr) {
+      if(play_pos < play_line->ntoks) {
+	replay_token(&play_line->toks[play_pos++]);
+	return;
+      }
+
+      /* record the rest of the line after the replayed tokens */
+      rec_line = play_line;
+      rec_count = play_line->ntoks;
+      if(rec_count > rec_size) {
+	rec_size = rec_count+32;
+	rec_toks = mem_realloc(rec_toks, rec_size*sizeof(struct cached_token));
+      }
+      memcpy(rec_toks, play_line->toks, rec_count*sizeof(struct cached_token));
+    }
+    play_line = NULL;
+  }
+
+  if(rec_line != NULL && line_buf_ptr != lc_ptr)
+    end_recording();
+  lc = rec_line;
+  scan_error = 0;
+
+  cur_token.text = NULL;
+  scan_token();
+  if(cur_token.text == NULL) {
+    cur_token.text = token_string;
+    cur_token.len = strlen(token_string);
+  }
+
+  /* a token may have made the tokenizer move to another line */
+  if(lc != NULL && lc == rec_line)
+    record_token();
+}
+
+/*
+ * Save the current token to a peek queue slot.
+ * Tokens that aren't views of the source line are all
+ * short enough for the 'str' field.
+ */
+static void
+save_token(struct peeked *p)
+{
+  p->tok = cur_token;
+  if(cur_token.text == token_string) {
+    strcpy(p->str, token_string);
+    p->tok.text = NULL;
+  }
+}
+
+/*
+ * Make a saved token the current token again
+ */
+static void
+restore_token(struct peeked *p)
+{
+  cur_token = p->tok;
+  if(p->tok.text == NULL) {
+    strcpy(token_string, p->str);
+    cur_token.text = token_string;
+    cur_token.len = strlen(token_string);
+  } else {
+    set_token_text(p->tok.text, p->tok.len);
+  }
+}
+
+/*
+ * Get the next token to cur_token
+ */
+void
+get_token(void)
+{
+  if(peek_count > 0) {
+    restore_token(&peek_queue[peek_first]);
+    peek_first = (peek_first+1) % PEEK_MAX;
+    peek_count--;
+    return;
+  }
+  next_token();
+}
+
+/*
+ * Look at the n'th token after the current one (1 <= n <= PEEK_MAX)
+ * without consuming it. Peeking doesn't go past the end of the line,
+ * past that the newline (or end of file) token is returned again.
+ */
+struct token *
+peek_token(int n)
+{
+  struct peeked cur, *p;
+
+  if(n > PEEK_MAX)
+    fatal_error("peek_token(): too far ahead");
+
+  if(peek_count < n) {
+    save_token(&cur);
+    while(peek_count < n) {
+      p = (peek_count > 0 ?
+	   &peek_queue[(peek_first+peek_count-1) % PEEK_MAX] : &cur);
+      if(p->tok.type == TOK_NEWLINE || p->tok.type == TOK_EOF)
+	break;
+      next_token();
+      p = &peek_queue[(peek_first+peek_count) % PEEK_MAX];
+      save_token(p);
+      p->pos = tok_start_ptr;
+      p->first = tok_start_char;
+      peek_count++;
+    }
+    restore_token(&cur);
+  }
+
+  if(peek_count == 0)
+    return &cur_token;
+  if(n > peek_count)
+    n = peek_count;
+  return &peek_queue[(peek_first+n-1) % PEEK_MAX].tok;
+}
+
+/*
+ * Drop the peeked tokens and move the tokenizer back to
+ * the start of the first one. This is needed before the
+ * rest of the line is read as raw characters.
+ */
+static void
+unpeek_tokens(void)
+{
+  struct peeked *p;
+
+  if(peek_count > 0) {
+    p = &peek_queue[peek_first];
+    line_buf_ptr = p->pos;
+    tok_char = p->first;
+    peek_count = 0;
+  }
+}
+
+/*
+ * Turn the current local id token (=name) into '=' followed
+ * by an identifier, for places where '=' is an assignment
+ */
+void
+split_local_id(void)
+{
+  struct peeked *p;
+
+  if(token_type != TOK_LOCAL_ID)
+    return;
+
+  /* insert the name at the front of the peek queue */
+  peek_first = (peek_first+PEEK_MAX-1) % PEEK_MAX;
+  if(peek_count == PEEK_MAX)
+    peek_count--;
+  p = &peek_queue[peek_first];
+  p->tok = cur_token;
+  p->tok.type = lookup_keyword(cur_token.text, cur_token.len);
+  p->tok.line_off++;
+  p->pos = cur_token.text+1;
+  p->first = (unsigned char)cur_token.text[0];
+  peek_count++;
+
+  token_type = TOK_EQUAL;
+  strcpy(token_string, "=");
+  cur_token.text = token_string;
+  cur_token.len = 1;
+}
+
+/*
+ * Get the raw text of the current line after the character
+ * that follows the current token, without leading white space.
+ * Returns the length, and the text in *text.
+ */
+int
+get_rest_of_line(char **text)
+{
+  char *cp;
+
+  unpeek_tokens();
+  if(line_buf_ptr == NULL) {
+    *text = "";
+    return 0;
+  }
+
+  for(cp = line_buf_ptr; cp < line_end && (IS_SPACE(*cp) || *cp == '\n'); cp++)
+    ;
+  *text = cp;
+  return line_end-cp;
+}
+
 /* skip to the next line */
 void
 skip_eol(void)
 {
+  peek_count = 0;
   line_buf_ptr = NULL;
   tok_char = ' ';
 }
+
+/*
+ * Start skipping a conditional block from the current line.
+ * If the end of the block is known and 'jump' is set, the
+ * lines before the ELSE/ENDIF line are skipped directly.
+ */
+void
+begin_skip(int jump)
+{
+  struct inc_file *f;
+  struct line_cache *lc;
+  struct macro_line *ml;
+
+  skip_file = NULL;
+  if((f = current_file) == NULL || f->linenum <= 0)
+    return;
+
+  if(f->type == INC_FILE) {
+    if(f->linenum > f->v.f.src->nlines)
+      return;
+    lc = &f->v.f.src->lines[f->linenum-1];
+    if(lc->skip_to > 0) {
+      if(jump) {
+	f->v.f.pos = f->v.f.src->buf.data + lc->skip_pos;
+	f->linenum = lc->skip_to-1;
+      }
+      return;
+    }
+    skip_lc = lc;
+  } else {
+    ml = f->v.m.cur;
+    if(ml->skip_to != NULL) {
+      if(jump) {
+	f->v.m.ml = ml->skip_to;
+	f->linenum += ml->skip_lines-1;
+      }
+      return;
+    }
+    skip_ml = ml;
+    skip_args = 0;
+  }
+  skip_file = f;
+  skip_linenum = f->linenum;
+}
+
+/*
+ * The skip has ended at an ELSE/ENDIF on the current line,
+ * add the block to the index
+ */
+void
+end_skip(void)
+{
+  struct src_buf *sb;
+
+  if(skip_file == NULL || skip_file != current_file)
+    return;
+
+  if(skip_file->type == INC_FILE) {
+    /* a last line without a newline is a copy */
+    sb = &skip_file->v.f.src->buf;
+    if(line_start < sb->data || line_start >= sb->data + sb->size)
+      return;
+    skip_lc->skip_to = skip_file->linenum;
+    skip_lc->skip_pos = line_start - sb->data;
+  } else if(!skip_args) {
+    skip_ml->skip_lines = skip_file->linenum - skip_linenum;
+    skip_ml->skip_to = skip_file->v.m.cur;
+  }
+  skip_file = NULL;
+}
+
+/* check for IF, ELSE, ENDIF or END */
+static int
+is_cond_keyword(char *cp, int len)
+{
+  switch(len) {
+    case 2:
+      return (cp[0] | 0x20) == 'i' && (cp[1] | 0x20) == 'f';
+
+    case 4:
+      return (cp[0] | 0x20) == 'e' && (cp[1] | 0x20) == 'l'
+	&& (cp[2] | 0x20) == 's' && (cp[3] | 0x20) == 'e';
+
+    case 3:
+    case 5:
+      return (cp[0] | 0x20) == 'e' && (cp[1] | 0x20) == 'n'
+	&& (cp[2] | 0x20) == 'd'
+	&& (len == 3 || ((cp[3] | 0x20) == 'i' && (cp[4] | 0x20) == 'f'));
+  }
+  return 0;
+}
+
+/*
+ * Read the next line in a skipped conditional block, and look
+ * at its first word (or the word after a label) as raw text.
+ * Returns 0 if the line can't be IF, ELSE, ENDIF or END. Otherwise
+ * (also at the end of the source) returns 1 with the tokenizer at
+ * the start of the line, so that it can be read with get_token().
+ * The tokenizer must be at the start of a line (after skip_eol()).
+ */
+int
+read_skipped_line(void)
+{
+  char *cp, *ep;
+
+  if(next_line() != OK) {
+    tok_char = EOF;
+    return 1;
+  }
+
+  for(cp = line_start; IS_SPACE(*cp); cp++)
+    ;
+  if(IS_IDSTART(*cp)) {
+    for(ep = cp; IS_IDCHAR(*ep); ep++)
+      ;
+    if(is_cond_keyword(cp, ep-cp))
+      goto tokenize;
+
+    /* skip a label (or other identifier) and an optional colon */
+    for(cp = ep; IS_SPACE(*cp); cp++)
+      ;
+    if(*cp == ':') {
+      for(cp++; IS_SPACE(*cp); cp++)
+	;
+    }
+    for(ep = cp; IS_IDCHAR(*ep); ep++)
+      ;
+    if(is_cond_keyword(cp, ep-cp))
+      goto tokenize;
+  }
+  return 0;
+
+tokenize:
+  tok_char = ((unsigned char)(*line_buf_ptr++)); /* as in read_src_char() */
+  return 1;
+}